@@ -0,0 +1,311 @@
+(***********************************************************************)
+(* The OcamlExpat library                                              *)
+(*                                                                     *)
+(* Copyright 2002, 2003 Maas-Maarten Zeeman. All rights reserved. See  *)
+(* LICENCE for details.                                                *)
+(***********************************************************************)
+
+(* Benchmarks, run "make bench" to run all of them, or
+   "./bench.opt name ..." to run some of them. *)
+
+open Expat
+
+let rec_xml = "REC-xml-19980210.xml"
+
+let read_file filename =
+  let ic = open_in_bin filename in
+  let s = really_input_string ic (in_channel_length ic) in
+    close_in ic;
+    s
+
+let time f =
+  let start = Unix.gettimeofday () in
+  let result = f () in
+    (Unix.gettimeofday () -. start, result)
+
+(* Parse copies of the XML spec with 1..N domains, once with per-event
+   handlers, and once in batched mode, which runs without the runtime
+   lock. *)
+let parallel () =
+  let doc = read_file rec_xml in
+  let documents = List.init 64 (fun _ -> Parallel.String doc) in
+  let per_event p =
+    let n = ref 0 in
+      set_start_element_handler p (fun _ _ -> incr n);
+      fun () -> !n
+  in
+  let batched p =
+    let n = ref 0 in
+      set_event_batch_handler p
+	(iter_events (function Start_element _ -> incr n | _ -> ()));
+      fun () -> !n
+  in
+    Printf.printf "parallel: %d documents of %d bytes\n"
+      (List.length documents) (String.length doc);
+    for domains = 1 to Domain.recommended_domain_count () do
+      let t1, _ = time (fun () -> Parallel.parse_many ~domains per_event documents) in
+      let t2, _ = time (fun () -> Parallel.parse_many ~domains batched documents) in
+	Printf.printf "  %2d domains: per-event %7.3fs  batched %7.3fs\n%!"
+	  domains t1 t2
+    done
+
+(* Many small messages, with a parser created for each of them, and
+   with parsers taken from a pool. *)
+let pool () =
+  let message =
+    "<?xml version='1.0'?><envelope><header><id>42</id></header><body>" ^
+      String.concat ""
+        (List.init 40 (fun i -> Printf.sprintf "<item n='%d'>value</item>" i)) ^
+      "</body></envelope>"
+  in
+  let count = 200_000 in
+  let setup p = set_start_element_handler p (fun _ _ -> ()) in
+  let fresh () =
+    for _i = 1 to count do
+      let p = parser_create ~encoding:None in
+	setup p;
+	parse p message;
+	final p
+    done
+  in
+  let pooled () =
+    let pool =
+      Pool.create (fun () -> let p = parser_create ~encoding:None in setup p; p)
+    in
+      for _i = 1 to count do
+	Pool.with_parser pool (fun p -> parse p message; final p)
+      done
+  in
+  let t1, () = time fresh in
+  let t2, () = time pooled in
+    Printf.printf "pool: %d messages of %d bytes\n" count (String.length message);
+    Printf.printf "  parser per message %7.3fs  pooled %7.3fs\n%!" t1 t2
+
+(* The time taken by a minor collection, depending on the number of
+   live parsers, against that with as many handler tuples registered as
+   plain global roots, as each parser did before it used a generational
+   global root. *)
+external plain_roots : int -> unit = "bench_PlainRoots"
+
+let minor_gc () =
+  let per_minor_gc () =
+    let rounds = 2000 in
+    let t, () =
+      time (fun () ->
+	      for _i = 1 to rounds do
+		ignore (Sys.opaque_identity (Array.make 10 0));
+		Gc.minor ()
+	      done)
+    in
+      t /. float rounds *. 1e6
+  in
+    print_endline "minor_gc: time per minor collection";
+    List.iter (fun live ->
+		 plain_roots live;
+		 let before = per_minor_gc () in
+		   plain_roots 0;
+		   let parsers =
+		     Array.init live (fun _ ->
+					let p = parser_create ~encoding:None in
+					  set_start_element_handler p (fun _ _ -> ());
+					  p)
+		   in
+		   let after = per_minor_gc () in
+		     Printf.printf "  %6d live parsers: plain roots %8.2fus  \
+				    generational roots %8.2fus\n%!"
+		       (Array.length parsers) before after)
+      [0; 1_000; 10_000; 50_000]
+
+(* Parsers allocating with malloc and from an arena, reused for many
+   small documents and for copies of the XML spec. *)
+let arena () =
+  let message =
+    "<envelope><header><id>42</id></header><body>" ^
+      String.concat ""
+        (List.init 40 (fun i -> Printf.sprintf "<item n='%d'>value</item>" i)) ^
+      "</body></envelope>"
+  in
+  let spec = read_file rec_xml in
+  let run create doc count =
+    let p = create ~encoding:None in
+      set_start_element_handler p (fun _ _ -> ());
+      for _i = 1 to count do
+	parse p doc;
+	final p;
+	parser_reset p ~encoding:None
+      done
+  in
+    print_endline "arena: time with malloc and with an arena";
+    List.iter (fun (name, doc, count) ->
+		 let t1, () = time (fun () -> run parser_create doc count) in
+		 let t2, () = time (fun () -> run parser_create_arena doc count) in
+		   Printf.printf "  %d x %-14s malloc %7.3fs  arena %7.3fs\n%!"
+		     count name t1 t2)
+      ["small messages", message, 200_000;
+       rec_xml, spec, 200]
+
+(* How long the parser keeps an event loop from running other work:
+   the durations of the calls to parse for 1 MB chunks of a large
+   document, against those of the calls to parse_step for the same
+   chunks. *)
+let latency () =
+  let doc =
+    "<feed>" ^
+      String.concat ""
+	(List.init 200_000 (fun i ->
+			      Printf.sprintf "<entry id='%d'><title>entry %d</title></entry>"
+				i i)) ^
+      "</feed>"
+  in
+  let chunk = 1 lsl 20 in
+  let num_chunks = (String.length doc + chunk - 1) / chunk in
+  let chunks =
+    List.init num_chunks (fun i ->
+			    let off = i * chunk in
+			      String.sub doc off (min chunk (String.length doc - off)))
+  in
+  let stalls run =
+    let p = parser_create ~encoding:None in
+    let samples = ref [] in
+    let timed f = let t, r = time f in samples := t :: !samples; r in
+      set_start_element_handler p (fun _ _ -> ());
+      set_character_data_handler p ignore;
+      run p timed;
+      let samples = Array.of_list !samples in
+	Array.sort compare samples;
+	samples
+  in
+  let percentile samples q =
+    let n = Array.length samples in
+      samples.(min (n - 1) (int_of_float (q *. float n))) *. 1e3
+  in
+  let report name samples =
+    Printf.printf "  %-22s %6d stalls p50 %8.3fms  p99 %8.3fms  max %8.3fms\n%!"
+      name (Array.length samples) (percentile samples 0.5)
+      (percentile samples 0.99) (percentile samples 1.)
+  in
+    Printf.printf "latency: %d bytes in chunks of %d bytes\n"
+      (String.length doc) chunk;
+    report "parse"
+      (stalls (fun p timed ->
+		 List.iter (fun s -> timed (fun () -> parse p s)) chunks;
+		 final p));
+    List.iter (fun max_events ->
+		 report (Printf.sprintf "parse_step %d events" max_events)
+		   (stalls (fun p timed ->
+			      List.iteri (fun i s ->
+					    feed p ~final:(i = num_chunks - 1) s;
+					    while timed (fun () -> parse_step p ~max_events)
+						  = `Suspended do () done)
+				chunks)))
+      [100; 1000; 10_000]
+
+(* Copying a large document while changing an attribute of a few of its
+   elements, with a default handler appending to a buffer, and with
+   Rewrite. *)
+let rewrite () =
+  let doc =
+    "<feed>" ^
+      String.concat ""
+	(List.init 200_000 (fun i ->
+			      Printf.sprintf "<entry id='%d'><title>entry %d</title></entry>"
+				i i)) ^
+      "<link href='old'/></feed>"
+  in
+  let with_buffer () =
+    let p = parser_create ~encoding:None in
+    let buf = Buffer.create (String.length doc) in
+      set_default_handler p (fun token ->
+	if String.starts_with ~prefix:"<link" token then
+	  Buffer.add_string buf "<link href=\"new\"/>"
+	else Buffer.add_string buf token);
+      parse p doc;
+      final p;
+      Buffer.contents buf
+  in
+  let rw = Rewrite.create () in
+    Rewrite.on_start_element rw "link" (fun _ _ -> Some [("href", "new")]);
+    let t1, _ = time with_buffer in
+    let t2, _ = time (fun () -> Rewrite.string rw doc) in
+      Printf.printf "rewrite: %d bytes\n" (String.length doc);
+      Printf.printf "  default handler %7.3fs  Rewrite %7.3fs\n%!" t1 t2
+
+(* Parsing the XML spec and writing it back, with a printer escaping
+   one character at a time to a buffer, and with Writer. *)
+let writer () =
+  let spec = read_file rec_xml in
+  let rounds = 100 in
+  let round_trip start_element end_element text =
+    let p = parser_create ~encoding:None in
+      set_start_element_handler p start_element;
+      set_end_element_handler p end_element;
+      set_character_data_handler p text;
+      parse p spec;
+      final p
+  in
+  let with_buffer () =
+    let buf = Buffer.create (String.length spec) in
+    let escape s =
+      String.iter (function
+		       '<' -> Buffer.add_string buf "&lt;"
+		     | '&' -> Buffer.add_string buf "&amp;"
+		     | '>' -> Buffer.add_string buf "&gt;"
+		     | '"' -> Buffer.add_string buf "&quot;"
+		     | c -> Buffer.add_char buf c) s
+    in
+      for _i = 1 to rounds do
+	Buffer.clear buf;
+	round_trip
+	  (fun name attrs ->
+	     Buffer.add_char buf '<';
+	     Buffer.add_string buf name;
+	     List.iter (fun (k, v) ->
+			  Buffer.add_char buf ' ';
+			  Buffer.add_string buf k;
+			  Buffer.add_string buf "=\"";
+			  escape v;
+			  Buffer.add_char buf '"') attrs;
+	     Buffer.add_char buf '>')
+	  (fun name ->
+	     Buffer.add_string buf "</";
+	     Buffer.add_string buf name;
+	     Buffer.add_char buf '>')
+	  escape;
+	ignore (Buffer.contents buf)
+      done
+  in
+  let with_writer () =
+    let w = Writer.create () in
+      for _i = 1 to rounds do
+	round_trip (Writer.start_element w) (fun _ -> Writer.end_element w)
+	  (Writer.text w);
+	ignore (Writer.contents w)
+      done
+  in
+  let t1, () = time with_buffer in
+  let t2, () = time with_writer in
+    Printf.printf "writer: %d x %s parsed and written back\n" rounds rec_xml;
+    Printf.printf "  Buffer %7.3fs  Writer %7.3fs\n%!" t1 t2
+
+let benchmarks =
+  ["parallel", parallel;
+   "pool", pool;
+   "arena", arena;
+   "latency", latency;
+   "rewrite", rewrite;
+   "writer", writer;
+   "minor_gc", minor_gc]
+
+let () =
+  let names =
+    match Array.to_list Sys.argv with
+	_ :: (_ :: _ as names) -> names
+      | _ -> List.map fst benchmarks
+  in
+    List.iter (fun name ->
+		 match List.assoc_opt name benchmarks with
+		     Some f -> f ()
+		   | None ->
+		       Printf.eprintf "unknown benchmark %s\n" name;
+		       exit 2)
+      names
@@ -0,0 +1,55 @@
+/***********************************************************************/
+/* The OcamlExpat library                                              */
+/*                                                                     */
+/* Copyright 2002, 2003 Maas-Maarten Zeeman. All rights reserved. See  */
+/* LICENCE for details.                                                */
+/***********************************************************************/
+
+/* Stubs used by bench.ml only */
+
+#include <stdlib.h>
+
+#include <caml/mlvalues.h>
+#include <caml/alloc.h>
+#include <caml/memory.h>
+#include <caml/fail.h>
+
+/*
+ * Handler tuples registered as plain global roots, which is what each
+ * parser did before the stubs used generational global roots. The size
+ * is the one of the handler tuple of a parser.
+ */
+#define BENCH_HANDLERS 13
+
+static value *bench_roots = NULL;
+static intnat bench_num_roots = 0;
+
+/*
+ * external plain_roots : int -> unit = "bench_PlainRoots"
+ *
+ * Replace the registered roots with n new ones.
+ */
+CAMLprim value
+bench_PlainRoots(value n)
+{
+    intnat i;
+
+    for(i = 0; i < bench_num_roots; i++)
+	caml_remove_global_root(&bench_roots[i]);
+    free(bench_roots);
+    bench_roots = NULL;
+    bench_num_roots = 0;
+
+    if(Long_val(n) == 0)
+	return Val_unit;
+    bench_roots = malloc(Long_val(n) * sizeof *bench_roots);
+    if(bench_roots == NULL)
+	caml_raise_out_of_memory();
+    for(i = 0; i < Long_val(n); i++) {
+	bench_roots[i] = Val_unit;
+	caml_register_global_root(&bench_roots[i]);
+	bench_roots[i] = caml_alloc(BENCH_HANDLERS, 0);
+    }
+    bench_num_roots = Long_val(n);
+    return Val_unit;
+}
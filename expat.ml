@@ -9,6 +9,9 @@ open Bytes
 
 type expat_parser
 
+type bigarray =
+  (char, Bigarray.int8_unsigned_elt, Bigarray.c_layout) Bigarray.Array1.t
+
 type xml_error =
     NONE
   | NO_MEMORY
@@ -37,6 +40,23 @@ type xml_error =
   | ENTITY_DECLARED_IN_PE
   | FEATURE_REQUIRES_XML_DTD
   | CANT_CHANGE_FEATURE_ONCE_PARSING
+  | UNBOUND_PREFIX
+  | UNDECLARING_PREFIX
+  | INCOMPLETE_PE
+  | XML_DECL
+  | TEXT_DECL
+  | PUBLICID
+  | SUSPENDED
+  | NOT_SUSPENDED
+  | ABORTED
+  | FINISHED
+  | SUSPEND_PE
+  | RESERVED_PREFIX_XML
+  | RESERVED_PREFIX_XMLNS
+  | RESERVED_NAMESPACE_URI
+  | INVALID_ARGUMENT
+  | NO_BUFFER
+  | AMPLIFICATION_LIMIT_BREACH
 
 exception Expat_error of xml_error
 
@@ -66,6 +86,14 @@ external parser_create_ns : encoding:string option -> separator:char
   -> expat_parser = "expat_XML_ParserCreateNS"
 external external_entity_parser_create : expat_parser -> string option
   -> string option -> expat_parser = "expat_XML_ExternalEntityParserCreate"
+external parser_reset : expat_parser -> encoding:string option -> unit =
+    "expat_XML_ParserReset"
+
+external arena_parser_create : string option -> char option -> expat_parser =
+    "expat_ParserCreateArena"
+let parser_create_arena ~encoding = arena_parser_create encoding None
+let parser_create_ns_arena ~encoding ~separator =
+  arena_parser_create encoding (Some separator)
 
 (* calls needed to parse *)
 external parse : expat_parser -> string -> unit =  "expat_XML_Parse"
@@ -74,8 +102,40 @@ external parse_sub : expat_parser -> string -> int -> int -> unit =
     "expat_XML_ParseSub"
 external parse_sub_bytes : expat_parser -> bytes -> int -> int -> unit =
     "expat_XML_ParseSub"
+external parse_bigarray_sub : expat_parser -> bigarray -> int -> int -> unit =
+    "expat_XML_ParseBigarraySub"
+external parse_fd : expat_parser -> Unix.file_descr -> unit =
+    "expat_XML_ParseFd"
+external parse_channel : expat_parser -> in_channel -> unit =
+    "expat_XML_ParseChannel"
 external final : expat_parser -> unit = "expat_XML_Final"
 
+external feed : expat_parser -> string -> bool -> unit = "expat_Feed"
+external parse_step : expat_parser -> int -> bool = "expat_ParseStep"
+
+let feed p ?(final = false) s = feed p s final
+
+let parse_step p ~max_events =
+  if parse_step p max_events then `Suspended else `Done
+
+external parse_stream : expat_parser -> string -> bool -> (unit -> unit) ->
+  unit = "expat_ParseStream"
+
+let parse_stream p ?(final = false) ?(document_end = ignore) s =
+  parse_stream p s final document_end
+
+let parse_bigarray p buf =
+  parse_bigarray_sub p buf 0 (Bigarray.Array1.dim buf)
+
+(* map the whole file and hand the mapping to expat, the data never *)
+(* touches the OCaml heap *)
+let parse_file_mmap p filename =
+  let fd = Unix.openfile filename [Unix.O_RDONLY] 0 in
+    Fun.protect ~finally:(fun () -> Unix.close fd)
+      (fun () ->
+	 let buf = Unix.map_file fd Bigarray.char Bigarray.c_layout false [|-1|] in
+	   parse_bigarray p (Bigarray.array1_of_genarray buf))
+
 (* start element handler calls *)
 external set_start_element_handler : expat_parser ->
   (string -> (string * string) list -> unit) -> unit =
@@ -83,6 +143,35 @@ external set_start_element_handler : expat_parser ->
 external reset_start_element_handler : expat_parser -> unit =
     "expat_XML_ResetStartElementHandler"
 
+type attributes
+external set_start_element_handler_lazy : expat_parser ->
+  (string -> attributes -> unit) -> unit = "expat_SetStartElementHandlerLazy"
+external attributes_length : attributes -> int = "expat_AttributesLength"
+external attribute_name : attributes -> int -> string = "expat_AttributeName"
+external attribute_value : attributes -> int -> string = "expat_AttributeValue"
+external find_attribute : attributes -> string -> string option =
+    "expat_FindAttribute"
+
+(* interned names *)
+external intern : expat_parser -> string -> int = "expat_Intern"
+external symbol_name : expat_parser -> int -> string = "expat_SymbolName"
+external attribute_symbol : attributes -> int -> int = "expat_AttributeSymbol"
+external set_start_element_handler_sym : expat_parser ->
+  (int -> attributes -> unit) -> unit = "expat_SetStartElementHandlerSym"
+external set_end_element_handler_sym : expat_parser -> (int -> unit) -> unit =
+    "expat_SetEndElementHandlerSym"
+
+(* names split into a namespace and a local name *)
+external set_start_element_handler_ns : expat_parser ->
+  (int -> string -> attributes -> unit) -> unit =
+    "expat_SetStartElementHandlerNS"
+external set_end_element_handler_ns : expat_parser ->
+  (int -> string -> unit) -> unit = "expat_SetEndElementHandlerNS"
+external attribute_namespace : attributes -> int -> int =
+    "expat_AttributeNamespace"
+external attribute_local_name : attributes -> int -> string =
+    "expat_AttributeLocalName"
+
 (* end element handler calls *)
 external set_end_element_handler : expat_parser -> (string -> unit) -> unit =
     "expat_XML_SetEndElementHandler"
@@ -94,6 +183,14 @@ external set_character_data_handler : expat_parser -> (string -> unit) -> unit =
     "expat_XML_SetCharacterDataHandler"
 external reset_character_data_handler : expat_parser -> unit =
     "expat_XML_ResetCharacterDataHandler"
+external set_character_data_coalescing : expat_parser -> bool -> unit =
+    "expat_SetCharacterDataCoalescing"
+external set_ignore_whitespace : expat_parser -> bool -> unit =
+    "expat_SetIgnoreWhitespace"
+external set_mixed_content_elements : expat_parser -> string list -> unit =
+    "expat_SetMixedContentElements"
+external set_character_data_handler_sub : expat_parser ->
+  (bytes -> int -> int -> unit) -> unit = "expat_SetCharacterDataHandlerSub"
 
 (* processing instruction handler calls *)
 external set_processing_instruction_handler : expat_parser ->
@@ -125,6 +222,18 @@ external set_default_handler : expat_parser -> (string -> unit) -> unit =
     "expat_XML_SetDefaultHandler"
 external reset_default_handler : expat_parser -> unit =
     "expat_XML_ResetDefaultHandler"
+external set_default_handler_sub : expat_parser ->
+  (bytes -> int -> int -> unit) -> unit = "expat_SetDefaultHandlerSub"
+
+(* source spans *)
+external set_start_element_handler_span : expat_parser ->
+  (int -> int -> bool -> unit) -> unit = "expat_SetStartElementHandlerSpan"
+external set_end_element_handler_span : expat_parser ->
+  (int -> int -> bool -> unit) -> unit = "expat_SetEndElementHandlerSpan"
+external set_character_data_handler_span : expat_parser ->
+  (int -> int -> bool -> unit) -> unit = "expat_SetCharacterDataHandlerSpan"
+external set_default_handler_span : expat_parser ->
+  (int -> int -> bool -> unit) -> unit = "expat_SetDefaultHandlerSpan"
 
 (* external entity ref handler *)
 external set_external_entity_ref_handler : expat_parser ->
@@ -133,6 +242,56 @@ external set_external_entity_ref_handler : expat_parser ->
 external reset_external_entity_ref_handler : expat_parser -> unit =
     "expat_XML_ResetDefaultHandler"
 
+(* namespace declaration handler calls *)
+external set_start_namespace_decl_handler : expat_parser ->
+  (string option -> string option -> unit) -> unit =
+    "expat_XML_SetStartNamespaceDeclHandler"
+external reset_start_namespace_decl_handler : expat_parser -> unit =
+    "expat_XML_ResetStartNamespaceDeclHandler"
+external set_end_namespace_decl_handler : expat_parser ->
+  (string option -> unit) -> unit = "expat_XML_SetEndNamespaceDeclHandler"
+external reset_end_namespace_decl_handler : expat_parser -> unit =
+    "expat_XML_ResetEndNamespaceDeclHandler"
+
+(* batched events *)
+type event =
+    Start_element of string * (string * string) list
+  | End_element of string
+  | Character_data of string
+
+(* records packed by the C stubs, see record_start_element in *)
+(* expat_stubs.c for the layout *)
+type events = { records : string; strings : string }
+
+external set_event_batch_handler : expat_parser -> (events -> unit) -> unit =
+    "expat_SetEventBatchHandler"
+external reset_event_batch_handler : expat_parser -> unit =
+    "expat_ResetEventBatchHandler"
+
+let fold_events f acc { records; strings } =
+  let word i = Int32.to_int (String.get_int32_ne records (4 * i)) in
+  let str i = String.sub strings (word i) (word (i + 1)) in
+  let rec attrs i n =
+    if n = 0 then []
+    else
+      let attr = (str i, str (i + 2)) in
+	attr :: attrs (i + 4) (n - 1)
+  in
+  let num_words = String.length records / 4 in
+  let rec loop acc i =
+    if i >= num_words then acc
+    else match word i with
+	0 ->
+	  let nattrs = word (i + 3) in
+	  let ev = Start_element (str (i + 1), attrs (i + 4) nattrs) in
+	    loop (f acc ev) (i + 4 + 4 * nattrs)
+      | 1 -> loop (f acc (End_element (str (i + 1)))) (i + 3)
+      | _ -> loop (f acc (Character_data (str (i + 1)))) (i + 3)
+  in
+    loop acc 0
+
+let iter_events f events = fold_events (fun () ev -> f ev) () events
+
 (* some general parser query calls *)
 external get_current_byte_index : expat_parser -> int =
     "expat_XML_GetCurrentByteIndex"
@@ -149,4 +308,337 @@ external get_base : expat_parser -> string option =
 external set_base : expat_parser -> string option -> unit =
     "expat_XML_SetBase"
 
+external get_memory_usage : expat_parser -> int = "expat_GetMemoryUsage"
+
+external stop : expat_parser -> unit = "expat_Stop"
+
+external skip_subtree : expat_parser -> unit = "expat_SkipSubtree"
+
+external set_path_filter : expat_parser -> string list -> unit =
+    "expat_SetPathFilter"
+
+(* a pool of parsers, which are reset instead of created anew *)
+module Pool = struct
+  type t = {
+    create : unit -> expat_parser;
+    encoding : string option;
+    max_size : int;
+    mutex : Mutex.t;
+    mutable parsers : expat_parser list;
+    mutable size : int;
+  }
+
+  let create ?(max_size = 64) ?encoding create =
+    { create; encoding; max_size; mutex = Mutex.create ();
+      parsers = []; size = 0 }
+
+  let acquire pool =
+    Mutex.lock pool.mutex;
+    match pool.parsers with
+	p :: rest ->
+	  pool.parsers <- rest;
+	  pool.size <- pool.size - 1;
+	  Mutex.unlock pool.mutex;
+	  p
+      | [] ->
+	  Mutex.unlock pool.mutex;
+	  pool.create ()
+
+  let release pool p =
+    parser_reset p ~encoding:pool.encoding;
+    Mutex.lock pool.mutex;
+    if pool.size < pool.max_size then begin
+      pool.parsers <- p :: pool.parsers;
+      pool.size <- pool.size + 1
+    end;
+    Mutex.unlock pool.mutex
+
+  let with_parser pool f =
+    let p = acquire pool in
+      match f p with
+	  result -> release pool p; result
+	| exception e -> release pool p; raise e
+end
+
+(* parse documents in parallel, with one worker per domain *)
+module Parallel = struct
+  type document =
+      String of string
+    | Bigarray of bigarray
+    | File of string
+
+  let parse_document p = function
+      String s -> parse p s
+    | Bigarray buf -> parse_bigarray p buf
+    | File filename -> parse_file_mmap p filename
+
+  let parse_many ?(domains = Domain.recommended_domain_count ()) ?create
+      ?encoding setup documents =
+    (* the first document of a worker is parsed as the others are *)
+    let create =
+      match create with
+	  Some create -> create
+	| None -> fun () -> parser_create ~encoding
+    in
+    let documents = Array.of_list documents in
+    let results = Array.make (Array.length documents) None in
+    let next = Atomic.make 0 in
+    (* the workers take the next document until there are none left, *)
+    (* reusing their parser *)
+    let rec work p =
+      let i = Atomic.fetch_and_add next 1 in
+	if i < Array.length documents then begin
+	  let result =
+	    try
+	      let finish = setup p in
+		parse_document p documents.(i);
+		final p;
+		Ok (finish ())
+	    with e -> Error e
+	  in
+	    results.(i) <- Some result;
+	    parser_reset p ~encoding;
+	    work p
+	end
+    in
+    let work () = work (create ()) in
+    let num_domains = max 1 (min domains (Array.length documents)) in
+    let workers = List.init (num_domains - 1) (fun _ -> Domain.spawn work) in
+      work ();
+      List.iter Domain.join workers;
+      Array.to_list
+	(Array.map (function
+			Some (Ok r) -> r
+		      | Some (Error e) -> raise e
+		      | None -> assert false) results)
+end
+
+(* pull parsing, see expat_SetPullMode in expat_stubs.c *)
+module Pull = struct
+  external set_pull_mode : expat_parser -> int -> unit = "expat_SetPullMode"
+  external pull_parse : expat_parser -> string -> int -> int -> bool -> bool =
+      "expat_PullParse"
+  external pull_parse_bigarray :
+    expat_parser -> bigarray -> int -> int -> bool -> bool =
+      "expat_PullParseBigarray"
+  external pull_resume : expat_parser -> bool = "expat_PullResume"
+  external pull_take : expat_parser -> events = "expat_PullTake"
+
+  type cursor = {
+    parser : expat_parser;
+    (* parses the next chunk of input, and tells whether expat was *)
+    (* suspended; raises End_of_file once the last one was parsed *)
+    feed : unit -> bool;
+    events : event Queue.t;
+    mutable suspended : bool;
+    mutable finished : bool;
+  }
+
+  let chunk_size = 65536
+
+  let create ?parser ?(batch = 64) feed =
+    let parser =
+      match parser with
+	  Some p -> p
+	| None -> parser_create ~encoding:None
+    in
+      set_pull_mode parser batch;
+      { parser; feed = feed parser; events = Queue.create ();
+	suspended = false; finished = false }
+
+  (* feed length bytes in chunks, the last one being final *)
+  let chunks parse length parser =
+    let pos = ref 0 and final = ref false in
+      fun () ->
+	if !final then raise End_of_file;
+	let off = !pos in
+	let len = min chunk_size (length - off) in
+	  pos := off + len;
+	  final := !pos = length;
+	  parse parser off len !final
+
+  let of_string ?parser ?batch s =
+    create ?parser ?batch
+      (chunks (fun p off len final -> pull_parse p s off len final)
+	 (String.length s))
+
+  let of_bigarray ?parser ?batch buf =
+    create ?parser ?batch
+      (chunks (fun p off len final -> pull_parse_bigarray p buf off len final)
+	 (Bigarray.Array1.dim buf))
+
+  let of_fd ?parser ?batch fd =
+    let buf = Bytes.create chunk_size in
+    let final = ref false in
+      create ?parser ?batch (fun p () ->
+	if !final then raise End_of_file;
+	let n = Unix.read fd buf 0 chunk_size in
+	  final := n = 0;
+	  pull_parse p (Bytes.unsafe_to_string buf) 0 n !final)
+
+  (* parse until there is an event, or the end of the document *)
+  let rec fill c =
+    if Queue.is_empty c.events && not c.finished then begin
+      (match if c.suspended then pull_resume c.parser else c.feed () with
+	   suspended -> c.suspended <- suspended
+	 | exception End_of_file -> c.finished <- true);
+      iter_events (fun ev -> Queue.add ev c.events) (pull_take c.parser);
+      fill c
+    end
+
+  let peek c =
+    fill c;
+    match Queue.peek_opt c.events with
+	Some ev -> ev
+      | None -> raise End_of_file
+
+  let next c =
+    fill c;
+    match Queue.take_opt c.events with
+	Some ev -> ev
+      | None -> raise End_of_file
+end
+
+(* trees built by the C stubs, see expat_TreeParse in expat_stubs.c *)
+module Tree = struct
+  type words = (int32, Bigarray.int32_elt, Bigarray.c_layout) Bigarray.Array1.t
+
+  type tree = {
+    nodes : words;
+    attributes : words;
+    names : words;
+    strings : bigarray;
+  }
+
+  type node = int
+
+  external parse_tree : char option -> string -> tree = "expat_TreeParse"
+  external tree_string : bigarray -> int -> int -> string = "expat_TreeString"
+
+  let node_words = 6
+  let attribute_words = 3
+
+  let parse ?ns s = parse_tree ns s
+
+  let word (a : words) i = Int32.to_int a.{i}
+  let field t node i = word t.nodes (node_words * node + i)
+  let option i = if i < 0 then None else Some i
+
+  let length t = Bigarray.Array1.dim t.nodes / node_words
+  let root _ = 0
+  let is_element t node = field t node 0 = 0
+
+  let symbol_name t symbol =
+    tree_string t.strings (word t.names (2 * symbol))
+      (word t.names (2 * symbol + 1))
+
+  let name t node =
+    if not (is_element t node) then invalid_arg "Expat.Tree.name";
+    symbol_name t (field t node 1)
+
+  let first_child t node = option (field t node 2)
+  let next_sibling t node = option (field t node 3)
+
+  let rec fold_siblings f acc t = function
+      None -> acc
+    | Some node -> fold_siblings f (f acc node) t (next_sibling t node)
+
+  let fold_children f acc t node = fold_siblings f acc t (first_child t node)
+  let iter_children f t node = fold_children (fun () n -> f n) () t node
+  let children t node =
+    List.rev (fold_children (fun acc n -> n :: acc) [] t node)
+
+  let attributes t node =
+    if not (is_element t node) then []
+    else
+      let first = field t node 4 in
+	List.init (field t node 5) (fun i ->
+	  let a = attribute_words * (first + i) in
+	    (symbol_name t (word t.attributes a),
+	     tree_string t.strings (word t.attributes (a + 1))
+	       (word t.attributes (a + 2))))
+
+  let attribute t node key = List.assoc_opt key (attributes t node)
+
+  let rec add_text buf t node =
+    if is_element t node then iter_children (add_text buf t) t node
+    else
+      Buffer.add_string buf
+	(tree_string t.strings (field t node 4) (field t node 5))
+
+  let text t node =
+    if is_element t node then begin
+      let buf = Buffer.create 64 in
+	add_text buf t node;
+	Buffer.contents buf
+    end else tree_string t.strings (field t node 4) (field t node 5)
+end
+
+(* rewriting, see expat_Rewrite in expat_stubs.c *)
+module Rewrite = struct
+  type handler =
+    string -> (string * string) list -> (string * string) list option
+
+  type t = { handlers : (string, handler) Hashtbl.t }
+
+  external rewrite : string list -> handler -> Unix.file_descr option ->
+    string -> Unix.file_descr option -> string = "expat_Rewrite"
+
+  let create () = { handlers = Hashtbl.create 8 }
+
+  let on_start_element t name handler = Hashtbl.replace t.handlers name handler
+
+  let run t input s output =
+    rewrite (Hashtbl.fold (fun name _ names -> name :: names) t.handlers [])
+      (fun name attrs -> (Hashtbl.find t.handlers name) name attrs)
+      input s output
+
+  let string t s = run t None s None
+  let string_to_fd t s fd = ignore (run t None s (Some fd))
+  let fd t input output = ignore (run t (Some input) "" (Some output))
+end
+
+(* writing, see expat_WriterCreate in expat_stubs.c *)
+module Writer = struct
+  type writer
+
+  external writer_create : Unix.file_descr option -> writer =
+      "expat_WriterCreate"
+  external writer_start_element : writer -> string ->
+    (string * string) list -> unit = "expat_WriterStartElement"
+  external writer_end_element : writer -> string -> unit =
+      "expat_WriterEndElement"
+  external writer_text : writer -> string -> unit = "expat_WriterText"
+  external writer_raw : writer -> string -> unit = "expat_WriterRaw"
+  external writer_contents : writer -> string = "expat_WriterContents"
+  external writer_flush : writer -> unit = "expat_WriterFlush"
+
+  type t = {
+    writer : writer;
+    mutable open_elements : string list;
+    (* the length of open_elements *)
+    mutable depth : int;
+  }
+
+  let create ?fd () =
+    { writer = writer_create fd; open_elements = []; depth = 0 }
+
+  let start_element t name attrs =
+    writer_start_element t.writer name attrs;
+    t.open_elements <- name :: t.open_elements;
+    t.depth <- t.depth + 1
+
+  let end_element t =
+    match t.open_elements with
+	name :: rest ->
+	  writer_end_element t.writer name;
+	  t.open_elements <- rest;
+	  t.depth <- t.depth - 1
+      | [] -> invalid_arg "Expat.Writer.end_element"
 
+  let text t s = writer_text t.writer s
+  let raw t s = writer_raw t.writer s
+  let contents t = writer_contents t.writer
+  let flush t = writer_flush t.writer
+  let depth t = t.depth
+end
@@ -24,6 +24,12 @@ open Bytes
 (** The type of expat parsers *)
 type expat_parser
 
+(** The type of the character buffers which can be parsed without
+    copying them into the OCaml heap, for example the result of
+    [Unix.map_file]. *)
+type bigarray =
+  (char, Bigarray.int8_unsigned_elt, Bigarray.c_layout) Bigarray.Array1.t
+
 (** {5 Parser Creation} *)
 
 (** Create a new XML parser. If encoding is not empty, it specifies
@@ -35,6 +41,18 @@ val parser_create : encoding:string option -> expat_parser
 (** Create a new XML parser that has namespace processing in effect *)
 val parser_create_ns : encoding:string option -> separator:char -> expat_parser
 
+(** Same as {!parser_create} and {!parser_create_ns}, but the memory of
+    the parser is taken from an arena instead of being allocated block
+    by block. The arena is emptied at once by {!parser_reset}, which
+    makes these parsers cheaper for parsing many small documents with
+    a single parser, or with a {!Pool}. The arena only shrinks when the
+    parser is reset, so its memory is freed when it is collected. While
+    parsers of external entities created from it are alive, the parser
+    is reset in place instead, and its arena is not emptied. *)
+val parser_create_arena : encoding:string option -> expat_parser
+val parser_create_ns_arena :
+  encoding:string option -> separator:char -> expat_parser
+
 (** Create a new XML_Parser object for parsing an external general
     entity. Context is the context argument passed in a call to a
     external_entity_ref_handler. Other state information such as
@@ -45,6 +63,18 @@ val parser_create_ns : encoding:string option -> separator:char -> expat_parser
 val external_entity_parser_create :
   expat_parser -> string option -> string option -> expat_parser
 
+(** Reset the parser, so that it can be used to parse a new document.
+    The installed handlers are kept, other settings (the base, the
+    parameter entity parsing) go back to their defaults. [encoding] is
+    the same as for {!parser_create}. This avoids the cost of creating
+    a parser for each document, see also {!Pool}.
+    @raise Invalid_argument for parsers created with
+    {!external_entity_parser_create}
+    @raise Out_of_memory when a parser created with an arena cannot be
+    created anew, it then raises [Invalid_argument] until it is reset
+    again *)
+val parser_reset : expat_parser -> encoding:string option -> unit
+
 
 (** {5 Parsing} *)
 
@@ -64,14 +94,128 @@ val parse_sub : expat_parser -> string -> int -> int -> unit
     @raise Expat_error error *)
 val parse_sub_bytes : expat_parser -> bytes -> int -> int -> unit
 
+(** Let the parser parse a chunk of an XML document held in a
+    bigarray. The data is handed to expat directly, it is not copied
+    into the OCaml heap first.
+    @raise Expat_error error *)
+val parse_bigarray : expat_parser -> bigarray -> unit
+
+(** Let the parser parse a chunk of an XML document in a slice of a
+    bigarray.
+    @raise Expat_error error *)
+val parse_bigarray_sub : expat_parser -> bigarray -> int -> int -> unit
+
+(** Map the named file into memory and let the parser parse its
+    contents, see {!parse_bigarray}. Like the other parse functions
+    this does not call {!final}.
+    @raise Expat_error error
+    @raise Unix.Unix_error if the file can not be opened or mapped *)
+val parse_file_mmap : expat_parser -> string -> unit
+
+(** Read the file descriptor until end of file and let the parser
+    parse what was read. The data is read directly into the buffer of
+    the parser, and other threads can run while this function is
+    blocked in [read]. Like the other parse functions this does not
+    call {!final}.
+    @raise Expat_error error
+    @raise Unix.Unix_error if reading fails *)
+val parse_fd : expat_parser -> Unix.file_descr -> unit
+
+(** Same as {!parse_fd}, but reads from a channel.
+    @raise Expat_error error
+    @raise Sys_error if reading fails *)
+val parse_channel : expat_parser -> in_channel -> unit
+
 (** Inform the parser that the entire document has been parsed.  *)
 val final : expat_parser -> unit
 
+(** Stop parsing the current document, typically from a handler once
+    what was needed has been seen. No handler is called any more, and
+    the parse functions and {!final} do nothing until the parser is
+    reset with {!parser_reset}. *)
+val stop : expat_parser -> unit
+
+(** Skip the rest of the current element, typically from the start
+    element handler. No handler is called for its content, which expat
+    only tokenizes, and the next event delivered is the end of the
+    element. Only to be called from a handler.
+    @raise Invalid_argument when not parsing *)
+val skip_subtree : expat_parser -> unit
+
+(** Only deliver the start element, end element and character data
+    events of the elements matching one of the paths, and of their
+    content, to the handlers. The paths are evaluated by the C stubs,
+    so the rest of the document costs no call into OCaml.
+
+    A path is a sequence of steps, each being [/name] for a child or
+    [//name] for a descendant, where [name] is a name or [*] for any
+    name, like ["/feed/entry/id"] or ["//item"]. The last step may be
+    an attribute, [/@name] or [//@name], like ["//item/@sku"]: the
+    start and end of an element with matching attributes are then
+    delivered, with only those attributes, but not its content. Names
+    match either the whole name given by expat, or its local part for
+    parsers created with {!parser_create_ns}.
+
+    The filter applies to the next document, it is kept by
+    {!parser_reset}, and removed by an empty list.
+    @raise Invalid_argument if a path is not valid *)
+val set_path_filter : expat_parser -> string list -> unit
+
+(** {6 Parsing in steps}
+
+ A large chunk can keep {!parse} busy for a long time. To share a
+ thread with other work, as in an event loop, a chunk can be given to
+ {!feed} instead, and parsed by calling {!parse_step} until it returns
+ [`Done], yielding to the scheduler in between. *)
+
+(** Give the parser a chunk of the document, which is copied to its
+    buffer. [final] tells that it is the last one, as {!final} does.
+    @raise Invalid_argument if the previous chunk has not been parsed
+    completely *)
+val feed : expat_parser -> ?final:bool -> string -> unit
+
+(** Parse the chunk given to {!feed} until [max_events] events have
+    been delivered to the handlers or recorded, and return [`Suspended]
+    then, or [`Done] once the whole chunk has been parsed. A few more
+    events may be delivered when one token makes several of them, as
+    [<a/>] does.
+    @raise Expat_error error *)
+val parse_step : expat_parser -> max_events:int -> [`Done | `Suspended]
+
+(** {6 Streams of documents} *)
+
+(** Parse the next chunk of a stream of documents which follow each
+    other, as on a connection carrying one message after the other.
+    Once the root element of a document has ended, [document_end] is
+    called, and the parser is reset as by {!parser_reset}, keeping its
+    handlers and the encoding it was created with, to parse what
+    follows in the same chunk. A document can
+    span several chunks. The whitespace between two documents is
+    skipped, anything else is the start of the next one, which may have
+    an XML declaration. [final] tells that the chunk is the last one,
+    which must not end inside a document. After {!stop}, even at the
+    end of a root element, [document_end] is not called and nothing
+    more is parsed until the parser is reset.
+
+    Once this has been called, the parser must only be given input by
+    [parse_stream], and not be used for pull parsing or parsing in
+    steps, until it is reset with {!parser_reset}.
+    @raise Expat_error error
+    @raise Invalid_argument for a parser used for pull parsing or
+    parsing in steps *)
+val parse_stream : expat_parser -> ?final:bool ->
+  ?document_end:(unit -> unit) -> string -> unit
+
 (** {5 Handler Setting and Resetting}
 
  The strings that are passed to the handlers are always encoded in
  [UTF-8]. Your application is responsible for translation of these
  strings into other encodings.
+
+ An exception raised by a handler stops the parser, no other handler
+ is called, and the exception is raised again by the parse function
+ once expat has returned. The document cannot be parsed further, but
+ the parser can be reset with {!parser_reset}.
  *)
 
 (** {6 Start element setting and resetting} *)
@@ -80,6 +224,78 @@ val set_start_element_handler : expat_parser ->
   (string -> (string * string) list -> unit) -> unit
 val reset_start_element_handler : expat_parser -> unit
 
+(** The attributes of an element, in document order. They can only be
+    read while the handler which received them runs, afterwards the
+    functions below raise [Invalid_argument "Expat.attributes"]. *)
+type attributes
+
+(** Like {!set_start_element_handler}, but the attributes are not
+    copied to a list: the handler reads the ones it needs, so that
+    unused attributes cost nothing. It is reset with
+    {!reset_start_element_handler}. *)
+val set_start_element_handler_lazy : expat_parser ->
+  (string -> attributes -> unit) -> unit
+
+(** The number of attributes *)
+val attributes_length : attributes -> int
+
+(** The name and the value of the attribute at the given index.
+    @raise Invalid_argument if the index is out of bounds *)
+val attribute_name : attributes -> int -> string
+val attribute_value : attributes -> int -> string
+
+(** The value of the attribute with the given name, if any *)
+val find_attribute : attributes -> string -> string option
+
+(** {6 Interned names}
+
+ Each parser has a table of the element and attribute names it has
+ seen, in which a name is identified by an integer symbol. Handlers
+ taking symbols avoid copying the names, and can dispatch on them with
+ a [match]. Symbols stay the same for the life of the parser, across
+ {!parser_reset}, and are shared with the parsers created by
+ {!external_entity_parser_create}. *)
+
+(** The symbol of a name, which is added to the table if needed. This
+    is how the symbols of the names a handler is interested in are
+    known in advance: the first names interned get the symbols 0, 1,
+    and so on.
+    @raise Invalid_argument if the name contains a null character *)
+val intern : expat_parser -> string -> int
+
+(** The name of a symbol.
+    @raise Invalid_argument if the parser has no such symbol *)
+val symbol_name : expat_parser -> int -> string
+
+(** The symbol of the name of the attribute at the given index *)
+val attribute_symbol : attributes -> int -> int
+
+(** Like {!set_start_element_handler_lazy} and
+    {!set_end_element_handler}, with the symbol of the element name
+    instead of the name. They are reset with
+    {!reset_start_element_handler} and {!reset_end_element_handler}. *)
+val set_start_element_handler_sym : expat_parser ->
+  (int -> attributes -> unit) -> unit
+val set_end_element_handler_sym : expat_parser -> (int -> unit) -> unit
+
+(** {6 Namespace-qualified names}
+
+ A parser created with {!parser_create_ns} gives the name of an
+ element or attribute in a namespace as the namespace URI and the
+ local name, joined by the separator. The handlers below get them
+ apart: the namespace as the symbol of its URI (see {!symbol_name}),
+ or [-1] for a name which is not in a namespace, and the local name. *)
+
+val set_start_element_handler_ns : expat_parser ->
+  (int -> string -> attributes -> unit) -> unit
+val set_end_element_handler_ns : expat_parser ->
+  (int -> string -> unit) -> unit
+
+(** The namespace and the local name of the attribute at the given
+    index *)
+val attribute_namespace : attributes -> int -> int
+val attribute_local_name : attributes -> int -> string
+
 (** {6 End element setting and resetting} *)
 
 val set_end_element_handler : expat_parser -> (string -> unit) -> unit
@@ -90,6 +306,43 @@ val reset_end_element_handler : expat_parser -> unit
 val set_character_data_handler : expat_parser -> (string -> unit) -> unit
 val reset_character_data_handler : expat_parser -> unit
 
+(** Expat reports the text between two tags in several pieces: at line
+    ends, character references, and the boundaries of the parsed
+    chunks. With coalescing, the pieces are gathered by the C stubs,
+    and the character data handler is called once with all of them,
+    before the next event which is not character data. Pieces which
+    are only separated by events without a handler (for instance
+    comments when there is no comment handler) are delivered together.
+    This applies to batched events as well. Off by default. *)
+val set_character_data_coalescing : expat_parser -> bool -> unit
+
+(** When set, text which is only whitespace (spaces, tabs, line ends),
+    such as the indentation of a pretty-printed document, is dropped by
+    the C stubs without calling the character data handler. The pieces
+    of such text are held back until it is known whether the text has
+    anything else, so that whitespace is only dropped when it is the
+    whole text between two events. When this is changed in the middle
+    of a document, the elements which are open are taken as not mixed,
+    see {!set_mixed_content_elements}. Off by default. *)
+val set_ignore_whitespace : expat_parser -> bool -> unit
+
+(** The elements whose content is mixed, where whitespace which is
+    directly in them is kept even with {!set_ignore_whitespace}. Names
+    are given as the handlers get them, ["uri<separator>local"] for
+    parsers created with {!parser_create_ns}. This replaces the
+    previous list. *)
+val set_mixed_content_elements : expat_parser -> string list -> unit
+
+(** Like {!set_character_data_handler}, but the text is given as the
+    [len] bytes at [offset] in a scratch buffer, [handler buf offset
+    len]. The buffer belongs to the parser and is overwritten by the
+    next call, so it must not be kept after the handler returns: copy
+    what is needed. No string is allocated for the text, the buffer
+    only grows when some text does not fit. It is reset with
+    {!reset_character_data_handler}. *)
+val set_character_data_handler_sub : expat_parser ->
+  (bytes -> int -> int -> unit) -> unit
+
 (** {6 Processing Instruction handler setting and resetting} *)
 
 val set_processing_instruction_handler : expat_parser ->
@@ -114,6 +367,36 @@ val reset_end_cdata_handler : expat_parser -> unit
 val set_default_handler : expat_parser -> (string -> unit) -> unit
 val reset_default_handler : expat_parser -> unit
 
+(** The default handler getting a substring of a scratch buffer, see
+    {!set_character_data_handler_sub}. *)
+val set_default_handler_sub : expat_parser ->
+  (bytes -> int -> int -> unit) -> unit
+
+(** {6 Source spans}
+
+ When the document is at hand, in a string or a mapped file, the span
+ handlers are given where the text of an event is in the document,
+ rather than a copy of it: [handler start end verbatim], where [start]
+ and [end] are byte offsets from the start of the document. [verbatim]
+ tells whether the bytes of the span are the text of the event. They
+ are not when character or entity references were replaced, line ends
+ normalized, or the document is not in UTF-8, nor for the end of an
+ empty element, whose span is empty. The text then has to be read with
+ a regular handler.
+
+ The span handlers replace the regular ones of the same kind, which
+ reset them. Coalesced text has the span of all its pieces, which is
+ not verbatim when markup was left out in between. *)
+
+val set_start_element_handler_span : expat_parser ->
+  (int -> int -> bool -> unit) -> unit
+val set_end_element_handler_span : expat_parser ->
+  (int -> int -> bool -> unit) -> unit
+val set_character_data_handler_span : expat_parser ->
+  (int -> int -> bool -> unit) -> unit
+val set_default_handler_span : expat_parser ->
+  (int -> int -> bool -> unit) -> unit
+
 (** {6 External Entity Ref Handler setting and resetting} *)
 
 val set_external_entity_ref_handler :
@@ -122,6 +405,54 @@ val set_external_entity_ref_handler :
 	unit
 val reset_external_entity_ref_handler : expat_parser -> unit
 
+(** {6 Namespace Declaration Handlers setting and resetting}
+
+ Called with the prefix and the URI when a namespace comes into scope,
+ and with the prefix when it goes out of scope, for parsers created
+ with {!parser_create_ns}. The prefix is [None] for the default
+ namespace, the URI is [None] when it is undeclared with [xmlns=""]. *)
+
+val set_start_namespace_decl_handler : expat_parser ->
+  (string option -> string option -> unit) -> unit
+val reset_start_namespace_decl_handler : expat_parser -> unit
+
+val set_end_namespace_decl_handler : expat_parser ->
+  (string option -> unit) -> unit
+val reset_end_namespace_decl_handler : expat_parser -> unit
+
+(** {6 Batched events}
+
+ Calling an OCaml handler for every event has a cost which dominates
+ on documents with many small elements. In batched mode, start
+ element, end element and character data events are recorded by the
+ C stubs, and handed to the batch handler in one go after each call to
+ one of the parse functions (and {!final}).
+
+ When the batch handler is the only handler installed, expat runs
+ without the OCaml runtime lock, so several threads parsing with
+ different parsers use several cores. A parser must never be used by
+ two threads at the same time. *)
+
+type event =
+    Start_element of string * (string * string) list
+  | End_element of string
+  | Character_data of string
+
+(** A batch of recorded events. *)
+type events
+
+(** Install a batch handler. This replaces the start element, end
+    element and character data handlers; setting one of those
+    afterwards takes that kind of event out of the batch. Events
+    delivered by other handlers are not batched, so they are seen
+    before the batched events of the same chunk. *)
+val set_event_batch_handler : expat_parser -> (events -> unit) -> unit
+val reset_event_batch_handler : expat_parser -> unit
+
+(** Walk over the events of a batch, in document order. *)
+val iter_events : (event -> unit) -> events -> unit
+val fold_events : ('a -> event -> 'a) -> 'a -> events -> 'a
+
 (** {5 Parse Position Functions} *)
 
 val get_current_byte_index : expat_parser -> int
@@ -159,6 +490,23 @@ type xml_error =
   | ENTITY_DECLARED_IN_PE
   | FEATURE_REQUIRES_XML_DTD
   | CANT_CHANGE_FEATURE_ONCE_PARSING
+  | UNBOUND_PREFIX
+  | UNDECLARING_PREFIX
+  | INCOMPLETE_PE
+  | XML_DECL
+  | TEXT_DECL
+  | PUBLICID
+  | SUSPENDED
+  | NOT_SUSPENDED
+  | ABORTED
+  | FINISHED
+  | SUSPEND_PE
+  | RESERVED_PREFIX_XML
+  | RESERVED_PREFIX_XMLNS
+  | RESERVED_NAMESPACE_URI
+  | INVALID_ARGUMENT
+  | NO_BUFFER
+  | AMPLIFICATION_LIMIT_BREACH
 
 (** Exception raised by parse function to report error conditions *)
 exception Expat_error of xml_error
@@ -175,6 +523,12 @@ val set_base : expat_parser -> string option -> unit
 (** Get the base for resolving relative URIs. *)
 val get_base : expat_parser -> string option
 
+(** The number of bytes expat currently has allocated for the parser,
+    or the size of the arena of a parser created with an arena. The
+    garbage collector is told about this memory, so that it speeds up
+    when parsers grow large. *)
+val get_memory_usage : expat_parser -> int
+
 (** Parameter entity handling types *)
 type xml_param_entity_parsing_choice =
     NEVER
@@ -188,4 +542,218 @@ val set_param_entity_parsing :
 (** Return the Expat library version as a string (e.g. "expat_1.95.1" *)
 val expat_version : unit -> string
 
-
+(** {5 Parser Pools} *)
+
+(** A pool of parsers which are configured once, and reset with
+    {!parser_reset} when they are given back to the pool, instead of
+    creating a new parser for each document. Pools can be shared
+    between domains. *)
+module Pool : sig
+  type t
+
+  (** [create make] makes an empty pool, [make] is called to create
+      and configure a parser when the pool is empty. At most [max_size]
+      (by default 64) parsers are kept in the pool. [encoding] is
+      passed to {!parser_reset}. *)
+  val create :
+    ?max_size:int -> ?encoding:string -> (unit -> expat_parser) -> t
+
+  (** Take a parser from the pool, or make a new one. *)
+  val acquire : t -> expat_parser
+
+  (** Reset the parser and give it back to the pool. *)
+  val release : t -> expat_parser -> unit
+
+  (** [with_parser pool f] calls [f] with a parser from the pool, and
+      gives it back afterwards, even when [f] raises. *)
+  val with_parser : t -> (expat_parser -> 'a) -> 'a
+end
+
+(** {5 Parallel Parsing} *)
+
+(** Parse many documents at once, using several domains. *)
+module Parallel : sig
+  type document =
+      String of string
+    | Bigarray of bigarray
+    | File of string  (** Parsed with {!parse_file_mmap} *)
+
+  (** [parse_many setup documents] parses the documents on up to
+      [domains] domains (by default [Domain.recommended_domain_count
+      ()]). Each domain makes one parser with [create] (by default
+      [parser_create ~encoding]), and resets it with
+      [parser_reset ~encoding] between documents. [setup] is called
+      before each document to install the handlers, and returns the
+      function which computes the result once the document has been
+      parsed. The results are
+      returned in the order of [documents]; if parsing one of the
+      documents raises, the first such exception is re-raised after all
+      domains are done.
+
+      [setup] and the handlers run on different domains at the same
+      time, so they must not share unsynchronised mutable state. *)
+  val parse_many :
+    ?domains:int -> ?create:(unit -> expat_parser) -> ?encoding:string ->
+    (expat_parser -> unit -> 'a) -> document list -> 'a list
+end
+
+(** {5 Pull Parsing} *)
+
+(** A cursor over the events of a document, which the consumer asks
+    for one at a time instead of being called back, so that a decoder
+    can be written by recursive descent.
+
+    The events are recorded by the C stubs, and expat is suspended with
+    [XML_StopParser] every [batch] events (64 by default), to be resumed
+    once they have been consumed. At most a chunk of the input and a
+    batch of events are held at a time.
+
+    The cursor installs its own start element, end element and
+    character data handlers in [parser], by default a new parser. The
+    other handlers of [parser] are called as usual, and do not count in
+    the batch. *)
+module Pull : sig
+  type cursor
+
+  val of_string : ?parser:expat_parser -> ?batch:int -> string -> cursor
+  val of_bigarray : ?parser:expat_parser -> ?batch:int -> bigarray -> cursor
+
+  (** Read the document from a file descriptor, until end of file. *)
+  val of_fd : ?parser:expat_parser -> ?batch:int -> Unix.file_descr -> cursor
+
+  (** The next event of the document.
+      @raise End_of_file at the end of the document
+      @raise Expat_error when the document is not well-formed *)
+  val next : cursor -> event
+
+  (** The next event, which is not consumed. *)
+  val peek : cursor -> event
+end
+
+(** {5 Trees} *)
+
+(** Documents parsed to a tree by the C stubs, without calling into
+    OCaml. The nodes are kept in a few bigarrays, outside of the OCaml
+    heap, and the strings are only copied when they are read. *)
+module Tree : sig
+  type tree
+
+  (** An element or a text node of a tree. *)
+  type node
+
+  (** Parse a whole document. Namespaces are processed as with
+      {!parser_create_ns} when [ns] is given. Adjacent character data
+      is merged into one text node; comments and processing
+      instructions are left out.
+      @raise Expat_error error *)
+  val parse : ?ns:char -> string -> tree
+
+  (** The number of nodes. *)
+  val length : tree -> int
+
+  (** The root element. *)
+  val root : tree -> node
+
+  val is_element : tree -> node -> bool
+
+  (** The name of an element.
+      @raise Invalid_argument for a text node *)
+  val name : tree -> node -> string
+
+  (** The text of a text node, or all the text in an element. *)
+  val text : tree -> node -> string
+
+  (** The attributes of an element, in document order, none for a text
+      node. *)
+  val attributes : tree -> node -> (string * string) list
+  val attribute : tree -> node -> string -> string option
+
+  val first_child : tree -> node -> node option
+  val next_sibling : tree -> node -> node option
+  val children : tree -> node -> node list
+  val iter_children : (node -> unit) -> tree -> node -> unit
+  val fold_children : ('a -> node -> 'a) -> 'a -> tree -> node -> 'a
+end
+
+(** {5 Rewriting} *)
+
+(** Documents copied from their input to their output as they are,
+    except for the start tags of a few elements, whose attributes are
+    given by OCaml. The markup which is kept is copied by the C stubs,
+    without calling into OCaml. Entity references are not replaced.
+    Documents in another encoding than UTF-8 are written in UTF-8, and
+    the encoding is dropped from their XML declaration. *)
+module Rewrite : sig
+  type t
+
+  (** A handler is given the name and the attributes of a start tag,
+      and returns the attributes it is to be written with, or [None] to
+      keep it as it is. *)
+  type handler =
+    string -> (string * string) list -> (string * string) list option
+
+  val create : unit -> t
+
+  (** Call the handler for the start tags of the elements with the given
+      name, as it would be given to a start element handler. *)
+  val on_start_element : t -> string -> handler -> unit
+
+  (** Rewrite a whole document.
+      @raise Expat_error error *)
+  val string : t -> string -> string
+
+  (** Rewrite a whole document to a file descriptor. The output is
+      written as the document is parsed, a block at a time.
+      @raise Expat_error error
+      @raise Unix.Unix_error when writing fails *)
+  val string_to_fd : t -> string -> Unix.file_descr -> unit
+
+  (** Rewrite the document read from the first file descriptor, until
+      end of file, to the second one.
+      @raise Expat_error error
+      @raise Unix.Unix_error when reading or writing fails *)
+  val fd : t -> Unix.file_descr -> Unix.file_descr -> unit
+end
+
+(** {5 Writing} *)
+
+(** Documents written to a buffer kept by the C stubs, which is reused,
+    or to a file descriptor. Text and attribute values are escaped,
+    and strings which need no escaping are copied at once. Names are
+    written as they are given. *)
+module Writer : sig
+  type t
+
+  (** When [fd] is given, the output is written to it a block at a time,
+      and by {!flush}; the functions writing to it raise
+      [Unix.Unix_error] when this fails. *)
+  val create : ?fd:Unix.file_descr -> unit -> t
+
+  (** Write a start tag. An element with no content is written as an
+      empty element tag.
+      @raise Invalid_argument when a value has a control character
+      which XML does not allow *)
+  val start_element : t -> string -> (string * string) list -> unit
+
+  (** Close the last element started.
+      @raise Invalid_argument when there is none *)
+  val end_element : t -> unit
+
+  (** @raise Invalid_argument when the text has a control character
+      which XML does not allow *)
+  val text : t -> string -> unit
+
+  (** Write a string as it is, a comment or an XML declaration for
+      instance. *)
+  val raw : t -> string -> unit
+
+  (** The number of open elements. *)
+  val depth : t -> int
+
+  (** Take the output written so far, which is no longer kept. *)
+  val contents : t -> string
+
+  (** Write the output to the file descriptor.
+      @raise Unix.Unix_error when writing fails *)
+  val flush : t -> unit
+end
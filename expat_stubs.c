@@ -10,29 +10,56 @@
 /* Stub code to interface Ocaml with Expat */
 
 #include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
 
 #include <expat.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 /* This is needed to support older versions of Expat 1.95.x */
 #ifndef XML_STATUS_OK
 #define XML_STATUS_OK    1
 #define XML_STATUS_ERROR 0
 #endif
 
+/* Needed for the channel primitives in caml/io.h */
+#define CAML_INTERNALS
+
 #include <caml/mlvalues.h>
 #include <caml/custom.h>
 #include <caml/alloc.h>
 #include <caml/memory.h>
 #include <caml/callback.h>
 #include <caml/fail.h>
+#include <caml/bigarray.h>
+#include <caml/io.h>
+#include <caml/signals.h>
+#include <caml/threads.h>
+#include <caml/unixsupport.h>
+
+/*
+ * The custom block of a parser holds its state, see expat_parser_data.
+ * Parser_data_val raises when the parser is unusable, see parser_data.
+ */
+#define Parser_data(v) \
+    (*((struct expat_parser_data **) Data_custom_val(v)))
+#define Parser_data_val(v) (parser_data(v))
+#define XML_Parser_val(v) (Parser_data_val(v)->parser)
 
-#define XML_Parser_val(v) (*((XML_Parser *) Data_custom_val(v)))
+static struct expat_parser_data *parser_data(value v);
 
 /*
  * Define the place where the handlers will be located inside the
- * handler tuple which is registered as global root. Handlers for
- * new functions should go here.
+ * handler tuple which is registered as generational global root.
+ * Handlers for new functions should go here.
  */
 enum expat_handler {
     EXPAT_START_ELEMENT_HANDLER,
@@ -44,895 +71,5168 @@ enum expat_handler {
     EXPAT_END_CDATA_HANDLER,
     EXPAT_DEFAULT_HANDLER,
     EXPAT_EXTERNAL_ENTITY_REF_HANDLER,
+    EXPAT_START_NAMESPACE_DECL_HANDLER,
+    EXPAT_END_NAMESPACE_DECL_HANDLER,
+    EXPAT_EVENT_BATCH_HANDLER,
+
+    /* Not a handler, the exception raised by a handler during a parse */
+    EXPAT_PENDING_EXCEPTION,
 
     NUM_HANDLERS /* keep this at the end */
 };
 
 /*
- * Return None if a null string is passed as a parameter, and Some str
- * if a string is used.
+ * A growable buffer, allocated with malloc.
  */
-static value
-Val_option_string(const char *str)
-{
-    CAMLparam0();
-    CAMLlocal2(some, some_str);
+struct expat_buffer {
+    char *data;
+    size_t len;
+    size_t size;
+};
 
-    if(str == NULL) {
-	CAMLreturn (Val_int(0));
-    } else {
-	some = caml_alloc(1, 0);
-	some_str = caml_copy_string(str);
-	Store_field(some, 0, some_str);
-	CAMLreturn (some);
-    }
-}
+/*
+ * The state kept for each parser, this is what is associated as user
+ * data with the expat parser. There is no state shared between
+ * parsers, so different parsers can be used from different domains
+ * at the same time, but a parser must only be used by one of them at
+ * a time.
+ */
+/*
+ * Memory accounting. Expat allocates through the memory handling suite
+ * below, which puts a header in front of each block, recording its size
+ * and the accounting of the parser it was allocated for. The suite is
+ * not told which parser is allocating, so the stubs set
+ * expat_current_memory around each call into expat which can allocate.
+ *
+ * A block can outlive the parser it was allocated for (a parser of an
+ * external entity shares the DTD of its parent), so the accounting is
+ * reference counted by the parser state and by every block.
+ */
+struct expat_memory {
+    size_t usage;	/* the bytes currently allocated */
+    size_t reported;	/* the most that has been reported to the GC */
+    size_t refs;
+    struct expat_arena *arena;	/* NULL for parsers using malloc */
+    size_t children;	/* the live parsers of external entities */
+};
+
+union expat_block_header {
+    struct {
+	struct expat_memory *memory;
+	size_t size;
+    } h;
+    max_align_t align;
+};
+
+static _Thread_local struct expat_memory *expat_current_memory = NULL;
 
 /*
- * Return NULL if we have None, Some str otherwise.
+ * An arena, from which the blocks of a parser created with
+ * parser_create_arena are bump allocated. Freeing a block only gives
+ * its space back when it is the last one allocated, the whole arena is
+ * emptied at once when the parser is reset. The chunks double in size,
+ * and the last one is kept when the arena is emptied, so that an arena
+ * which is reused stops calling malloc after a few documents.
  */
-static char *
-String_option_val(value string_option)
+struct expat_arena_chunk {
+    struct expat_arena_chunk *prev;
+    size_t size;
+    max_align_t data[];
+};
+
+struct expat_arena {
+    struct expat_arena_chunk *chunk;
+    char *next;
+    char *end;
+    void *last;		/* the last block, which can grow in place */
+};
+
+#define EXPAT_ARENA_CHUNK (64 * 1024)
+
+#define Arena_align(n) \
+    (((n) + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1))
+
+static void *
+arena_alloc(struct expat_arena *arena, size_t size)
 {
-    if (Is_block(string_option))
-	return String_val(Field(string_option, 0));
-    return NULL;
+    struct expat_arena_chunk *chunk;
+    char *block;
+
+    size = Arena_align(size);
+    if((size_t) (arena->end - arena->next) < size) {
+	size_t chunk_size = arena->chunk ? 2 * arena->chunk->size
+					 : EXPAT_ARENA_CHUNK;
+
+	if(chunk_size < size)
+	    chunk_size = size;
+	chunk = malloc(sizeof *chunk + chunk_size);
+	if(chunk == NULL)
+	    return NULL;
+	chunk->prev = arena->chunk;
+	chunk->size = chunk_size;
+	arena->chunk = chunk;
+	arena->next = (char *) chunk->data;
+	arena->end = arena->next + chunk_size;
+    }
+
+    block = arena->next;
+    arena->next += size;
+    arena->last = block;
+    return block;
 }
 
-static void
-xml_parser_finalize(value parser)
+static void *
+arena_realloc(struct expat_arena *arena, void *block, size_t old_size,
+	      size_t size)
 {
-    XML_Parser xml_parser = XML_Parser_val(parser);
-    value *handlers = XML_GetUserData(xml_parser);
+    void *copy;
 
-    /* The handlers are no longer needed */
-    *handlers = Val_unit;
-    caml_remove_global_root(handlers);
+    /* The last block can grow or shrink where it is */
+    if(block == arena->last
+       && Arena_align(size) <= (size_t) (arena->end - (char *) block)) {
+	arena->next = (char *) block + Arena_align(size);
+	return block;
+    }
 
-    /* Free the memory occupied by the parser */
-    XML_ParserFree(xml_parser);
-    caml_stat_free(handlers);
+    copy = arena_alloc(arena, size);
+    if(copy != NULL)
+	memcpy(copy, block, old_size < size ? old_size : size);
+    return copy;
 }
 
-static int
-xml_parser_compare(value v1, value v2)
+static void
+arena_free(struct expat_arena *arena, void *block)
 {
-    XML_Parser p1 = XML_Parser_val(v1);
-    XML_Parser p2 = XML_Parser_val(v2);
-    if(p1 == p2) return 0;
-    if(p1 < p2) return -1;
-    return 1;
+    if(block == arena->last) {
+	arena->next = block;
+	arena->last = NULL;
+    }
 }
 
-static long
-xml_parser_hash(value v)
+/*
+ * Empty the arena, keeping only its last, and largest, chunk.
+ */
+static void
+arena_rewind(struct expat_arena *arena)
 {
-    return (long) XML_Parser_val(v);
-}
+    struct expat_arena_chunk *chunk = arena->chunk;
 
-static struct custom_operations xml_parser_ops = {
-    "Expat_XML_Parser",
-    xml_parser_finalize,
-    xml_parser_compare,
-    xml_parser_hash,
-    custom_serialize_default,
-    custom_deserialize_default
-};
+    if(chunk == NULL)
+	return;
+    while(chunk->prev != NULL) {
+	struct expat_arena_chunk *prev = chunk->prev;
 
-static value
-create_ocaml_expat_parser(XML_Parser xml_parser)
+	chunk->prev = prev->prev;
+	free(prev);
+    }
+    arena->next = (char *) chunk->data;
+    arena->last = NULL;
+}
+
+/*
+ * The bytes held by the chunks of the arena, which the blocks allocated
+ * from it are in.
+ */
+static size_t
+arena_reserved(struct expat_arena *arena)
 {
-    CAMLparam0();
+    struct expat_arena_chunk *chunk;
+    size_t reserved = 0;
 
-    CAMLlocal1(parser);
-    int i;
-    value *handlers;
+    for(chunk = arena->chunk; chunk != NULL; chunk = chunk->prev)
+	reserved += chunk->size;
+    return reserved;
+}
 
-    /*
-     * I don't know how to find out how much memory the parser consumes,
-     * so I've set some figures here, which seems to do well.
-     */
-    parser = caml_alloc_custom(&xml_parser_ops, sizeof(XML_Parser), 1, 5000);
-    XML_Parser_val(parser) = xml_parser;
+static void
+arena_destroy(struct expat_arena *arena)
+{
+    while(arena->chunk != NULL) {
+	struct expat_arena_chunk *prev = arena->chunk->prev;
 
-    /*
-     * Malloc a value for a tuple which will contain the callback
-     * handlers and register it as global root.
-     */
-    handlers = caml_stat_alloc(sizeof *handlers);
-    *handlers = Val_unit;
-    caml_register_global_root(handlers);
+	free(arena->chunk);
+	arena->chunk = prev;
+    }
+    free(arena);
+}
 
-    /*
-     * Create a tuple which will hold the handlers.
-     */
-    *handlers = caml_alloc_tuple(NUM_HANDLERS);
-    for(i = 0; i < NUM_HANDLERS; i++) {
-	Field(*handlers, i) = Val_unit;
+static struct expat_memory *
+memory_create(int with_arena)
+{
+    struct expat_memory *memory = malloc(sizeof *memory);
+
+    if(memory == NULL)
+	caml_raise_out_of_memory();
+    memory->usage = 0;
+    memory->reported = 0;
+    memory->refs = 1;
+    memory->arena = NULL;
+    memory->children = 0;
+    if(with_arena) {
+	memory->arena = calloc(1, sizeof *memory->arena);
+	if(memory->arena == NULL) {
+	    free(memory);
+	    caml_raise_out_of_memory();
+	}
     }
+    return memory;
+}
 
-    /*
-     * Associate it as user data with the parser. This is possible because
-     * a global root will not be relocated.
-     */
-    XML_SetUserData(xml_parser, handlers);
+static void
+memory_release(struct expat_memory *memory)
+{
+    if(memory != NULL && --memory->refs == 0) {
+	if(memory->arena != NULL)
+	    arena_destroy(memory->arena);
+	free(memory);
+    }
+}
 
-    CAMLreturn (parser);
+static void *
+expat_malloc(size_t size)
+{
+    struct expat_memory *memory = expat_current_memory;
+    union expat_block_header *block;
+
+    if(memory != NULL && memory->arena != NULL)
+	block = arena_alloc(memory->arena, sizeof *block + size);
+    else
+	block = malloc(sizeof *block + size);
+    if(block == NULL)
+	return NULL;
+    block->h.memory = memory;
+    block->h.size = size;
+    if(memory != NULL) {
+	memory->usage += size;
+	memory->refs++;
+    }
+    return block + 1;
 }
 
 /*
- * parser_create : encoding:string option -> expat_parser =
- *   "expat_XML_ParserCreate"
+ * A block is reallocated and freed by the allocator it was allocated
+ * with, which is not necessarily the one of the current parser: the
+ * parser of an external entity can free blocks of its parent.
  */
-CAMLprim value
-expat_XML_ParserCreate(value encoding)
+static void *
+expat_realloc(void *ptr, size_t size)
+{
+    union expat_block_header *block;
+    struct expat_memory *memory;
+    size_t old_size;
+
+    if(ptr == NULL)
+	return expat_malloc(size);
+
+    block = (union expat_block_header *) ptr - 1;
+    memory = block->h.memory;
+    old_size = block->h.size;
+    if(memory != NULL && memory->arena != NULL)
+	block = arena_realloc(memory->arena, block, sizeof *block + old_size,
+			      sizeof *block + size);
+    else
+	block = realloc(block, sizeof *block + size);
+    if(block == NULL)
+	return NULL;
+    block->h.size = size;
+    if(memory != NULL)
+	memory->usage += size - old_size;
+    return block + 1;
+}
+
+static void
+expat_free(void *ptr)
 {
+    union expat_block_header *block;
+    struct expat_memory *memory;
+
+    if(ptr == NULL)
+	return;
 
-    return create_ocaml_expat_parser(XML_ParserCreate(String_option_val(encoding)));
+    block = (union expat_block_header *) ptr - 1;
+    memory = block->h.memory;
+    if(memory == NULL) {
+	free(block);
+	return;
+    }
+
+    memory->usage -= block->h.size;
+    if(memory->arena != NULL)
+	arena_free(memory->arena, block);
+    else
+	free(block);
+    memory_release(memory);
 }
 
+static const XML_Memory_Handling_Suite expat_memory_suite = {
+    expat_malloc,
+    expat_realloc,
+    expat_free
+};
+
 /*
- * parser_create_ns : encoding:string option -> separator:char -> expat_parser =
- *   "expat_XML_ParserCreateNS"
+ * Report the growth of a parser to the GC, which then speeds up as if
+ * that much memory had been allocated in the heap. A full major cycle
+ * is done for every EXPAT_MAX_MEMORY bytes reported.
  */
-CAMLprim value
-expat_XML_ParserCreateNS(value encoding, value sep)
+#define EXPAT_MAX_MEMORY (1024 * 1024 * 1024)
+
+static void
+memory_report(struct expat_memory *memory)
 {
-    return create_ocaml_expat_parser(XML_ParserCreateNS(String_option_val(encoding),
-							(char) Long_val(sep)));
+    if(memory->usage > memory->reported) {
+	caml_adjust_gc_speed(memory->usage - memory->reported,
+			     EXPAT_MAX_MEMORY);
+	memory->reported = memory->usage;
+    }
 }
 
 /*
- * external_entity_parser_create : expat_parser -> context:string option
- *               -> encoding:string option -> expat_parser =
- *   "expat_XML_ExternalEntityParserCreate"
+ * The C handlers installed in a parser. XML_ParserReset clears them,
+ * so they are kept here to install them again afterwards.
  */
-CAMLprim value
-expat_XML_ExternalEntityParserCreate(value p, value context, value encoding) {
-    CAMLparam3(p, context, encoding);
-    CAMLlocal1(parser);
-    int i;
-    value *handlers, *parent_handlers;
+struct expat_c_handlers {
+    XML_StartElementHandler start_element_handler;
+    XML_EndElementHandler end_element_handler;
+    XML_CharacterDataHandler character_data_handler;
+    XML_ProcessingInstructionHandler processing_instruction_handler;
+    XML_CommentHandler comment_handler;
+    XML_StartCdataSectionHandler start_cdata_handler;
+    XML_EndCdataSectionHandler end_cdata_handler;
+    XML_DefaultHandler default_handler;
+    XML_ExternalEntityRefHandler external_entity_ref_handler;
+    XML_StartNamespaceDeclHandler start_namespace_decl_handler;
+    XML_EndNamespaceDeclHandler end_namespace_decl_handler;
+};
 
-    XML_Parser xml_parser = \
-	XML_ExternalEntityParserCreate(XML_Parser_val(p),
-				       String_option_val(context),
-				       String_option_val(encoding));
-    parser = caml_alloc_custom(&xml_parser_ops, sizeof(XML_Parser), 1, 5000);
-    XML_Parser_val(parser) = xml_parser;
+struct expat_parser_data {
+    XML_Parser parser;
+    struct expat_c_handlers c;
+    struct expat_memory *memory;
 
     /*
-     * Malloc a value for a tuple which will contain the callback
-     * handlers and register it as global root.
+     * The memory of the parent of the parser of an external entity,
+     * whose children count it as long as it is alive.
      */
-    handlers = caml_stat_alloc(sizeof *handlers);
-    *handlers = Val_unit;
-    caml_register_global_root(handlers);
+    struct expat_memory *parent_memory;
+
+    /* The separator given to parser_create_ns, to create it anew */
+    int ns;
+    XML_Char separator[2];
 
     /*
-     * Create a tuple which will hold the handlers, and inherit the
-     * handlers installed in the parent parser.
+     * The encoding given when the parser was created, or NULL, which
+     * parse_stream resets it with between documents.
      */
-    parent_handlers = XML_GetUserData(xml_parser);
-    *handlers = caml_alloc_tuple(NUM_HANDLERS);
-    for(i = 0; i < NUM_HANDLERS; i++) {
-	Field(*handlers, i) = Field(*parent_handlers, i);
-    }
+    char *encoding;
 
     /*
-     * Associate inherited handlers it as user data with the
-     * parser. This is possible because a global root will not be
-     * relocated.
+     * The tuple with the callback handlers, registered as generational
+     * global root. It is only changed with Store_field.
      */
-    XML_SetUserData(xml_parser, handlers);
+    value handlers;
 
-    CAMLreturn (parser);
-}
+    /*
+     * Events recorded in batched event mode, see record_start_element
+     * for the layout of the records, and the strings they refer to.
+     */
+    struct expat_buffer events;
+    struct expat_buffer strings;
+    int out_of_memory;
+
+    /* The number of calls to XML_Parse running, and whether stop was called */
+    int parsing;
+    int stopped;
+
+    /*
+     * Expat is suspended once suspend_after events have been delivered
+     * or recorded, counting from when the parse step started or the
+     * events were last taken, 0 for never. In pull mode, the recorded
+     * events are not flushed.
+     */
+    int suspend_after;
+    int delivered;
+    int pull;
+
+    /*
+     * The number of elements open since skip_subtree was called, 0
+     * when not skipping. The handlers installed in expat are then the
+     * ones of install_skip_handlers instead of the ones in c.
+     */
+    int skip_depth;
+
+    /* Input given to feed, which parse_step has not started to parse */
+    int step_len;
+    int step_final;
+    int step_pending;
+    int step_suspended;
+
+    /*
+     * Character data which is being coalesced, until the next event
+     * which is not character data.
+     */
+    int coalesce;
+    struct expat_buffer text;
+
+    /* The source span of the text held back, see text_span_append */
+    XML_Index text_start;
+    XML_Index text_end;
+    int text_verbatim;
+
+    /*
+     * Whitespace suppression. text_is_content is set once the current
+     * text is known not to be whitespace only. The element stack has a
+     * byte per open element, telling whether it has mixed content, as
+     * given by the mixed array indexed by the symbol of its name.
+     */
+    int ignore_whitespace;
+    int text_is_content;
+    struct expat_buffer element_stack;
+    unsigned char *mixed;
+    size_t mixed_size;
+
+    /* Created by the first call to symbols_get */
+    struct expat_symbols *symbols;
+
+    /* Set by set_path_filter, see filter_start_element */
+    struct expat_path_filter *filter;
 
+    /*
+     * Stream mode, set by parse_stream: the depth of the current
+     * document, whether it has started, the bytes of it given to expat
+     * before the current call, and where its root element ended, or -1.
+     */
+    int stream;
+    int stream_depth;
+    int stream_started;
+    XML_Index stream_fed;
+    XML_Index stream_end;
+};
+
+#define Handler(data, h) Field((data)->handlers, (h))
 
 /*
- * get_base : expat_parser -> string option
+ * The state of a parser, which is unusable when it could not be created
+ * anew by parser_reset, see arena_parser_reset.
  */
-CAMLprim value
-expat_XML_GetBase(value parser)
+static struct expat_parser_data *
+parser_data(value v)
 {
-    CAMLparam1(parser);
-    CAMLlocal1(option);
-    const char *base = NULL;
-
-    base = XML_GetBase(XML_Parser_val(parser));
-    option = Val_option_string(base);
+    struct expat_parser_data *data = Parser_data(v);
 
-    CAMLreturn (option);
+    if(data->parser == NULL)
+	caml_invalid_argument("Expat: the parser could not be reset");
+    return data;
 }
 
 /*
- * val set_base : expat_parser -> string option -> unit
+ * Bill the allocations made by expat to the given parser, until
+ * memory_leave is called with the returned value.
  */
-CAMLprim value
-expat_XML_SetBase(value parser, value string)
+static struct expat_memory *
+memory_enter(XML_Parser xml_parser)
 {
-    CAMLparam2(parser, string);
+    struct expat_memory *saved = expat_current_memory;
+    struct expat_parser_data *data = XML_GetUserData(xml_parser);
 
-    XML_SetBase(XML_Parser_val(parser), String_option_val(string));
+    expat_current_memory = data->memory;
+    return saved;
+}
 
-    CAMLreturn (Val_unit);
+static void
+memory_leave(struct expat_memory *saved)
+{
+    expat_current_memory = saved;
 }
 
 /*
- * external get_current_byte_index : expat_parser -> int =
- *   "expat_XML_GetCurrentByteIndex"
+ * Handlers call OCaml with the _exn variants of caml_callback, as an
+ * exception must not unwind through expat, which would be left in an
+ * undefined state. The exception is kept in the parser state instead,
+ * expat is stopped, and parse_done raises it again once XML_Parse has
+ * returned. No handler is called in between, nor after stop.
  */
-CAMLprim value
-expat_XML_GetCurrentByteIndex(value parser)
+static int
+handlers_stopped(struct expat_parser_data *data)
 {
-    return Val_long(XML_GetCurrentByteIndex(XML_Parser_val(parser)));
+    return data->stopped || data->out_of_memory
+	|| Handler(data, EXPAT_PENDING_EXCEPTION) != Val_unit;
 }
 
 /*
- * external get_current_byte_count : expat_parser -> int =
- *   "expat_XML_GetCurrentByteCount"
+ * Called after each event delivered to OCaml or recorded, to suspend
+ * expat once suspend_after of them have been. Expat may still report
+ * the events of the current token, the end of an empty element for
+ * instance. In pull mode only the recorded events count, see
+ * handler_result.
  */
-CAMLprim value
-expat_XML_GetCurrentByteCount(value parser)
+static void
+count_event(struct expat_parser_data *data)
 {
-    return Val_long(XML_GetCurrentByteCount(XML_Parser_val(parser)));
+    if(data->suspend_after > 0 && data->parsing > 0
+       && ++data->delivered == data->suspend_after)
+	XML_StopParser(data->parser, XML_TRUE);
 }
 
-/*
- * external get_current_column_number : expat_parser -> int =
- *   "expat_XML_GetCurrentColumnNumber"
- */
-CAMLprim value
-expat_XML_GetCurrentColumnNumber(value parser)
+static void
+handler_result(struct expat_parser_data *data, value result)
 {
-    return Val_long(XML_GetCurrentColumnNumber(XML_Parser_val(parser)));
+    if(!Is_exception_result(result)) {
+	/* A cursor has nothing to take from the other handlers */
+	if(!data->pull)
+	    count_event(data);
+	return;
+    }
+
+    /* Outside of expat, when the stubs flush the text they hold back */
+    if(data->parsing == 0)
+	caml_raise(Extract_exception(result));
+
+    Store_field(data->handlers, EXPAT_PENDING_EXCEPTION,
+		Extract_exception(result));
+    XML_StopParser(data->parser, XML_FALSE);
 }
 
 /*
- * external get_current_line_number : expat_parser -> int =
- *   "expat_XML_GetCurrentLineNumber"
+ * Make room for len more bytes in buf. Returns 0 when out of memory.
+ * This does not touch the OCaml runtime, so it is safe to call it
+ * from the expat handlers in every mode.
  */
-CAMLprim value
-expat_XML_GetCurrentLineNumber(value parser)
+static int
+buffer_reserve(struct expat_buffer *buf, size_t len)
 {
-    return Val_long(XML_GetCurrentLineNumber(XML_Parser_val(parser)));
+    size_t size;
+    char *p;
+
+    if(buf->size - buf->len >= len)
+	return 1;
+
+    size = buf->size ? buf->size : 4096;
+    while(size - buf->len < len)
+	size *= 2;
+    p = realloc(buf->data, size);
+    if(p == NULL)
+	return 0;
+    buf->data = p;
+    buf->size = size;
+    return 1;
 }
 
-/*
- * external expat_version : unit -> string = "expat_XML_ExpatVersion"
- */
-CAMLprim value
-expat_XML_ExpatVersion(value unit)
+static int
+buffer_append(struct expat_buffer *buf, const void *src, size_t len)
 {
-    return caml_copy_string(XML_ExpatVersion());
+    if(!buffer_reserve(buf, len))
+	return 0;
+    memcpy(buf->data + buf->len, src, len);
+    buf->len += len;
+    return 1;
 }
 
-/*
- * external set_param_entity_parsing : expat_parser ->
- *   xml_param_entity_parsing_choice -> bool =
- *     "expat_XML_SetParamEntityParsing"
- */
-CAMLprim value
-expat_XML_SetParamEntityParsing(value parser, value choice) {
-    CAMLparam2(parser, choice);
-    CAMLreturn (Val_bool(XML_SetParamEntityParsing(XML_Parser_val(parser),
-						   Int_val(choice))));
+static void
+buffer_free(struct expat_buffer *buf)
+{
+    free(buf->data);
+    buf->data = NULL;
+    buf->len = buf->size = 0;
 }
 
 /*
- * external xml_error_to_string : xml_error -> string = "expat_XML_ErrorString"
+ * Path filters. A path such as "/feed/entry", "//item/@sku" or
+ * "//a/b" is compiled to a sequence of steps, each testing the name of
+ * an element, or of an attribute for the last one, against a symbol or
+ * any name. The filter keeps a level per open element, with a word per
+ * path in which bit k is set when the element and its ancestors match
+ * the first k steps of the path, step k being the one to test next.
+ * Descendant steps keep their bit set in the levels below. The first
+ * word of a level tells whether the end of its element is delivered.
+ *
+ * Inside an element which matches a path, everything is delivered and
+ * the levels are no longer computed, only the depth is counted. An
+ * element which only has attributes matching paths is delivered with
+ * those attributes, and without its content.
  */
-CAMLprim value
-expat_XML_ErrorString(value error_code)
-{
-    CAMLparam1(error_code);
-    const char *error_string = XML_ErrorString(Int_val(error_code));
+#define EXPAT_MAX_PATH_STEPS 63
 
-    /* XML_ErrorString(XML_ERROR_NONE) returns NULL, this check
-     * will return an empty string whenever this happens. Note:
-     * it checks for NULL, because that is the safest way.
-     */
-    if (error_string == NULL)
-	CAMLreturn (caml_alloc_string(0));
-    CAMLreturn (caml_copy_string(error_string));
+struct expat_path_step {
+    intnat name;	/* a symbol, unless any is set */
+    int any;
+    int descendant;
+    int attribute;
+};
+
+struct expat_path_filter {
+    size_t num_paths;
+    size_t *first;	/* first step of each path, and the end of the last */
+    struct expat_path_step *steps;
+    size_t level_size;	/* in words */
+    struct expat_buffer levels;
+    struct expat_buffer attrs;
+    size_t inside;
+};
+
+static void
+filter_free(struct expat_path_filter *filter)
+{
+    if(filter == NULL)
+	return;
+    free(filter->first);
+    free(filter->steps);
+    buffer_free(&filter->levels);
+    buffer_free(&filter->attrs);
+    free(filter);
 }
 
 /*
- * Raise an expat_error exception
+ * Forget the open elements, leaving the level of the document, where
+ * the first step of every path is to be tested.
  */
 static void
-expat_error(int error_code)
+filter_reset(struct expat_path_filter *filter)
 {
-    static value * expat_error_exn = NULL;
+    uint64_t *level = (uint64_t *) filter->levels.data;
+    size_t p;
+
+    level[0] = 0;
+    for(p = 0; p < filter->num_paths; p++)
+	level[1 + p] = 1;
+    filter->levels.len = filter->level_size * sizeof(uint64_t);
+    filter->inside = 0;
+}
 
-    if(expat_error_exn == NULL) {
-	expat_error_exn = caml_named_value("expat_error");
-	if(expat_error_exn == NULL) {
-	    caml_invalid_argument("Exception Expat_error not initialized");
-	}
+/*
+ * Symbol tables, which intern the element and attribute names given to
+ * the handlers taking symbols. A symbol is the index of its name in
+ * the table, so it stays the same for the life of the parser, across
+ * parser_reset. The parser of an external entity shares the table of
+ * its parent. Like the buffers, this does not touch the OCaml runtime.
+ */
+struct expat_symbols {
+    char **names;
+    size_t count;
+    size_t names_size;
+    uint32_t *slots;	/* symbol + 1, or 0 for an empty slot */
+    size_t slots_size;	/* a power of 2, at least twice count */
+    size_t refs;
+};
+
+static struct expat_symbols *
+symbols_create(void)
+{
+    struct expat_symbols *symbols = calloc(1, sizeof *symbols);
+
+    if(symbols == NULL)
+	return NULL;
+    symbols->slots_size = 64;
+    symbols->slots = calloc(symbols->slots_size, sizeof *symbols->slots);
+    if(symbols->slots == NULL) {
+	free(symbols);
+	return NULL;
+    }
+    symbols->refs = 1;
+    return symbols;
+}
+
+static void
+symbols_release(struct expat_symbols *symbols)
+{
+    size_t i;
+
+    if(symbols == NULL || --symbols->refs > 0)
+	return;
+    for(i = 0; i < symbols->count; i++)
+	free(symbols->names[i]);
+    free(symbols->names);
+    free(symbols->slots);
+    free(symbols);
+}
+
+/* FNV-1a */
+static uint32_t
+symbols_hash(const char *name, size_t len)
+{
+    uint32_t h = 2166136261u;
+    size_t i;
+
+    for(i = 0; i < len; i++) {
+	h ^= (unsigned char) name[i];
+	h *= 16777619u;
+    }
+    return h;
+}
+
+/*
+ * The slot of name in the table, or the empty slot where it goes. When
+ * name is NULL, the first empty slot for hash.
+ */
+static uint32_t *
+symbols_slot(uint32_t *slots, size_t slots_size, uint32_t hash,
+	     char **names, const char *name, size_t len)
+{
+    size_t i = hash & (slots_size - 1);
+
+    while(slots[i] != 0) {
+	const char *other = names[slots[i] - 1];
+
+	if(name != NULL && strncmp(other, name, len) == 0 && other[len] == '\0')
+	    break;
+	i = (i + 1) & (slots_size - 1);
+    }
+    return &slots[i];
+}
+
+static int
+symbols_grow(struct expat_symbols *symbols)
+{
+    size_t size = 2 * symbols->slots_size;
+    uint32_t *slots = calloc(size, sizeof *slots);
+    size_t i;
+
+    if(slots == NULL)
+	return 0;
+    for(i = 0; i < symbols->count; i++) {
+	const char *name = symbols->names[i];
+
+	*symbols_slot(slots, size, symbols_hash(name, strlen(name)),
+		      symbols->names, NULL, 0) = i + 1;
+    }
+    free(symbols->slots);
+    symbols->slots = slots;
+    symbols->slots_size = size;
+    return 1;
+}
+
+/*
+ * The symbol of the len bytes at name, which are interned if needed.
+ * Returns -1 when out of memory.
+ */
+static intnat
+symbols_intern(struct expat_symbols *symbols, const char *name, size_t len)
+{
+    uint32_t hash = symbols_hash(name, len);
+    uint32_t *slot = symbols_slot(symbols->slots, symbols->slots_size, hash,
+				  symbols->names, name, len);
+    char *copy;
+
+    if(*slot != 0)
+	return *slot - 1;
+
+    if(2 * (symbols->count + 1) > symbols->slots_size) {
+	if(!symbols_grow(symbols))
+	    return -1;
+	slot = symbols_slot(symbols->slots, symbols->slots_size, hash,
+			    symbols->names, NULL, 0);
+    }
+    if(symbols->count == symbols->names_size) {
+	size_t size = symbols->names_size ? 2 * symbols->names_size : 32;
+	char **names = realloc(symbols->names, size * sizeof *names);
+
+	if(names == NULL)
+	    return -1;
+	symbols->names = names;
+	symbols->names_size = size;
+    }
+    copy = malloc(len + 1);
+    if(copy == NULL)
+	return -1;
+    memcpy(copy, name, len);
+    copy[len] = '\0';
+
+    symbols->names[symbols->count] = copy;
+    *slot = ++symbols->count;
+    return symbols->count - 1;
+}
+
+/*
+ * The symbol of the len bytes at name, or -1 if it is not interned.
+ */
+static intnat
+symbols_find(struct expat_symbols *symbols, const char *name, size_t len)
+{
+    uint32_t *slot = symbols_slot(symbols->slots, symbols->slots_size,
+				  symbols_hash(name, len), symbols->names,
+				  name, len);
+
+    return (intnat) *slot - 1;
+}
+
+/*
+ * Return None if a null string is passed as a parameter, and Some str
+ * if a string is used.
+ */
+static value
+Val_option_string(const char *str)
+{
+    CAMLparam0();
+    CAMLlocal2(some, some_str);
+
+    if(str == NULL) {
+	CAMLreturn (Val_int(0));
+    } else {
+	some = caml_alloc(1, 0);
+	some_str = caml_copy_string(str);
+	Store_field(some, 0, some_str);
+	CAMLreturn (some);
+    }
+}
+
+/*
+ * Return NULL if we have None, Some str otherwise.
+ */
+static char *
+String_option_val(value string_option)
+{
+    if (Is_block(string_option))
+	return String_val(Field(string_option, 0));
+    return NULL;
+}
+
+static void
+xml_parser_finalize(value parser)
+{
+    struct expat_parser_data *data = Parser_data(parser);
+
+    /* The handlers are no longer needed */
+    caml_remove_generational_global_root(&data->handlers);
+
+    /*
+     * Free the memory occupied by the parser, which is NULL if it could
+     * not be created anew when it was reset.
+     */
+    if(data->parser != NULL)
+	XML_ParserFree(data->parser);
+    memory_release(data->memory);
+    if(data->parent_memory != NULL) {
+	data->parent_memory->children--;
+	memory_release(data->parent_memory);
+    }
+    buffer_free(&data->events);
+    buffer_free(&data->strings);
+    buffer_free(&data->text);
+    buffer_free(&data->element_stack);
+    free(data->mixed);
+    filter_free(data->filter);
+    symbols_release(data->symbols);
+    caml_stat_free(data->encoding);
+    caml_stat_free(data);
+}
+
+static int
+xml_parser_compare(value v1, value v2)
+{
+    struct expat_parser_data *p1 = Parser_data(v1);
+    struct expat_parser_data *p2 = Parser_data(v2);
+    if(p1 == p2) return 0;
+    if(p1 < p2) return -1;
+    return 1;
+}
+
+static long
+xml_parser_hash(value v)
+{
+    return (long) Parser_data(v);
+}
+
+static struct custom_operations xml_parser_ops = {
+    "Expat_XML_Parser",
+    xml_parser_finalize,
+    xml_parser_compare,
+    xml_parser_hash,
+    custom_serialize_default,
+    custom_deserialize_default
+};
+
+/*
+ * The symbol table of a parser, which is created on first use.
+ */
+static struct expat_symbols *
+symbols_get(struct expat_parser_data *data)
+{
+    if(data->symbols == NULL) {
+	data->symbols = symbols_create();
+	if(data->symbols == NULL)
+	    caml_raise_out_of_memory();
+    }
+    return data->symbols;
+}
+
+/*
+ * Intern the len bytes of name in the symbol table of a parser. Returns
+ * -1 when out of memory, without raising, so that it can be called
+ * from the expat handlers.
+ */
+static intnat
+intern_name(struct expat_parser_data *data, const char *name, size_t len)
+{
+    if(data->symbols == NULL && (data->symbols = symbols_create()) == NULL)
+	return -1;
+    return symbols_intern(data->symbols, name, len);
+}
+
+/*
+ * Allocate the state of a parser, with a fresh handler tuple which is
+ * registered as generational global root. When parent is not NULL, its
+ * handlers are inherited. The state takes over the reference to memory.
+ *
+ * A generational root is only scanned by the minor GC until the tuple
+ * has been promoted, after that setting a handler only records the
+ * modified field. Plain global roots are scanned at every minor GC,
+ * which costs a lot once there are many live parsers.
+ */
+static struct expat_parser_data *
+create_parser_data(XML_Parser xml_parser, struct expat_memory *memory,
+		   struct expat_parser_data *parent)
+{
+    CAMLparam0();
+    CAMLlocal1(handlers);
+    struct expat_parser_data *data;
+    struct expat_symbols *symbols = parent ? symbols_get(parent) : NULL;
+    unsigned char *mixed = NULL;
+    int i;
+
+    if(parent && parent->mixed_size > 0) {
+	mixed = malloc(parent->mixed_size);
+	if(mixed == NULL)
+	    caml_raise_out_of_memory();
+	memcpy(mixed, parent->mixed, parent->mixed_size);
+    }
+
+    /*
+     * Create a tuple which will hold the handlers.
+     */
+    handlers = caml_alloc_tuple(NUM_HANDLERS);
+    for(i = 0; i < NUM_HANDLERS; i++) {
+	Field(handlers, i) = parent ? Handler(parent, i) : Val_unit;
+    }
+
+    data = caml_stat_alloc(sizeof *data);
+    memset(data, 0, sizeof *data);
+    data->parser = xml_parser;
+    data->memory = memory;
+    data->handlers = handlers;
+    caml_register_generational_global_root(&data->handlers);
+    if(parent) {
+	data->c = parent->c;
+	data->coalesce = parent->coalesce;
+	data->ignore_whitespace = parent->ignore_whitespace;
+	data->ns = parent->ns;
+	memcpy(data->separator, parent->separator, sizeof data->separator);
+	data->mixed = mixed;
+	data->mixed_size = parent->mixed_size;
+	data->symbols = symbols;
+	symbols->refs++;
+    }
+
+    /*
+     * Associate it as user data with the parser. This is possible because
+     * the state is malloced, and will not be relocated.
+     */
+    XML_SetUserData(xml_parser, data);
+
+    CAMLreturnT (struct expat_parser_data *, data);
+}
+
+static value
+create_ocaml_expat_parser(XML_Parser xml_parser, struct expat_memory *memory,
+			  struct expat_parser_data *parent)
+{
+    CAMLparam0();
+    CAMLlocal1(parser);
+    struct expat_parser_data *data;
+
+    if(xml_parser == NULL) {
+	memory_release(memory);
+	caml_raise_out_of_memory();
+    }
+
+    data = create_parser_data(xml_parser, memory, parent);
+
+    /*
+     * Tell the GC how much memory the parser holds at this point, it is
+     * told about the growth of the parser after each parsed chunk.
+     */
+    parser = caml_alloc_custom_mem(&xml_parser_ops, sizeof data,
+				   memory->usage);
+    Parser_data(parser) = data;
+    memory->reported = memory->usage;
+
+    CAMLreturn (parser);
+}
+
+/*
+ * Create a parser whose memory is accounted for in memory, a namespace
+ * aware one when separator is not NULL.
+ */
+static XML_Parser
+xml_parser_create(const char *encoding, const XML_Char *separator,
+		  struct expat_memory *memory)
+{
+    struct expat_memory *saved = expat_current_memory;
+    XML_Parser xml_parser;
+
+    expat_current_memory = memory;
+    xml_parser = XML_ParserCreate_MM(encoding, &expat_memory_suite, separator);
+    memory_leave(saved);
+
+    return xml_parser;
+}
+
+static value
+parser_create(value encoding, value sep, int with_arena)
+{
+    CAMLparam2(encoding, sep);
+    CAMLlocal1(parser);
+    struct expat_memory *memory = memory_create(with_arena);
+    struct expat_parser_data *data;
+    XML_Char separator[2];
+
+    separator[0] = Is_block(sep) ? (char) Long_val(Field(sep, 0)) : '\0';
+    separator[1] = '\0';
+
+    parser = create_ocaml_expat_parser(
+	xml_parser_create(String_option_val(encoding),
+			  Is_block(sep) ? separator : NULL, memory),
+	memory, NULL);
+
+    data = Parser_data(parser);
+    data->ns = Is_block(sep);
+    memcpy(data->separator, separator, sizeof separator);
+    if(Is_block(encoding))
+	data->encoding = caml_stat_strdup(String_val(Field(encoding, 0)));
+
+    CAMLreturn (parser);
+}
+
+/*
+ * parser_create : encoding:string option -> expat_parser =
+ *   "expat_XML_ParserCreate"
+ */
+CAMLprim value
+expat_XML_ParserCreate(value encoding)
+{
+    return parser_create(encoding, Val_none, 0);
+}
+
+/*
+ * parser_create_ns : encoding:string option -> separator:char -> expat_parser =
+ *   "expat_XML_ParserCreateNS"
+ */
+CAMLprim value
+expat_XML_ParserCreateNS(value encoding, value sep)
+{
+    CAMLparam2(encoding, sep);
+    CAMLlocal1(some);
+
+    some = caml_alloc_some(sep);
+    CAMLreturn (parser_create(encoding, some, 0));
+}
+
+/*
+ * parser_create_arena : encoding:string option -> separator:char option ->
+ *   expat_parser = "expat_ParserCreateArena"
+ */
+CAMLprim value
+expat_ParserCreateArena(value encoding, value sep)
+{
+    return parser_create(encoding, sep, 1);
+}
+
+/*
+ * external_entity_parser_create : expat_parser -> context:string option
+ *               -> encoding:string option -> expat_parser =
+ *   "expat_XML_ExternalEntityParserCreate"
+ */
+CAMLprim value
+expat_XML_ExternalEntityParserCreate(value p, value context, value encoding) {
+    CAMLparam3(p, context, encoding);
+    CAMLlocal1(child);
+    struct expat_parser_data *parent_data;
+    struct expat_memory *memory = memory_create(0);
+    struct expat_memory *saved = expat_current_memory;
+    XML_Parser xml_parser;
+
+    expat_current_memory = memory;
+    xml_parser = XML_ExternalEntityParserCreate(XML_Parser_val(p),
+						String_option_val(context),
+						String_option_val(encoding));
+    memory_leave(saved);
+
+    /*
+     * Inherit the handlers installed in the parent parser, which is not
+     * to be freed as long as the child is alive.
+     */
+    parent_data = Parser_data_val(p);
+    child = create_ocaml_expat_parser(xml_parser, memory, parent_data);
+    Parser_data(child)->parent_memory = parent_data->memory;
+    parent_data->memory->refs++;
+    parent_data->memory->children++;
+    CAMLreturn (child);
+}
+
+
+/*
+ * Stop the parser when we run out of memory, parse_done will raise
+ * Out_of_memory when XML_Parse returns.
+ */
+static void
+record_failed(struct expat_parser_data *data)
+{
+    if(!data->out_of_memory) {
+	data->out_of_memory = 1;
+	XML_StopParser(data->parser, XML_FALSE);
+    }
+}
+
+/*
+ * The symbols of a name, and of its local part in a namespace, or -1
+ * when they were never interned, and so do not occur in any path.
+ */
+static void
+name_symbols(struct expat_parser_data *data, const char *name,
+	     intnat *full, intnat *local)
+{
+    const char *sep = data->ns ? strrchr(name, data->separator[0]) : NULL;
+
+    *full = symbols_find(data->symbols, name, strlen(name));
+    *local = sep ? symbols_find(data->symbols, sep + 1, strlen(sep + 1)) : -1;
+}
+
+static int
+path_test(const struct expat_path_step *step, intnat full, intnat local)
+{
+    return step->any || step->name == full || step->name == local;
+}
+
+/*
+ * The attributes which match the attribute steps active at level, as
+ * a NULL terminated array, or NULL if there are none.
+ */
+static const char **
+filter_attributes(struct expat_parser_data *data, const uint64_t *level,
+		  const char **attr)
+{
+    struct expat_path_filter *filter = data->filter;
+    const struct expat_path_step *last;
+    const char **selected;
+    size_t i, j = 0, p, k, n = 0;
+    intnat full, local;
+
+    while(attr[n])
+	n++;
+    if(!buffer_reserve(&filter->attrs, (n + 1) * sizeof(char *))) {
+	record_failed(data);
+	return NULL;
+    }
+    selected = (const char **) filter->attrs.data;
+
+    for(i = 0; i < n; i += 2) {
+	name_symbols(data, attr[i], &full, &local);
+	for(p = 0; p < filter->num_paths; p++) {
+	    k = filter->first[p + 1] - filter->first[p] - 1;
+	    last = filter->steps + filter->first[p + 1] - 1;
+	    if(last->attribute && (level[1 + p] >> k & 1)
+	       && path_test(last, full, local)) {
+		selected[j++] = attr[i];
+		selected[j++] = attr[i + 1];
+		break;
+	    }
+	}
+    }
+    selected[j] = NULL;
+    return j > 0 ? selected : NULL;
+}
+
+/*
+ * Push the level of a new element, and tell whether its start is to be
+ * delivered, with the attributes *attr, which may be changed to the
+ * ones matching the paths.
+ */
+static int
+filter_start_element(struct expat_parser_data *data, const char *name,
+		     const char ***attr)
+{
+    struct expat_path_filter *filter = data->filter;
+    size_t size = filter->level_size * sizeof(uint64_t);
+    const struct expat_path_step *steps;
+    const char **selected;
+    uint64_t *parent, *level, mask;
+    size_t p, k, n;
+    intnat full, local;
+    int element = 0, attribute = 0;
+
+    if(filter->inside > 0) {
+	filter->inside++;
+	return 1;
+    }
+
+    if(!buffer_reserve(&filter->levels, size)) {
+	record_failed(data);
+	return 0;
+    }
+    level = (uint64_t *) (filter->levels.data + filter->levels.len);
+    parent = level - filter->level_size;
+    filter->levels.len += size;
+
+    name_symbols(data, name, &full, &local);
+    level[0] = 0;
+    for(p = 0; p < filter->num_paths; p++) {
+	steps = filter->steps + filter->first[p];
+	n = filter->first[p + 1] - filter->first[p];
+	mask = 0;
+	for(k = 0; k < n; k++) {
+	    if(!(parent[1 + p] >> k & 1))
+		continue;
+	    if(steps[k].descendant)
+		mask |= (uint64_t) 1 << k;
+	    if(!steps[k].attribute && path_test(&steps[k], full, local))
+		mask |= (uint64_t) 1 << (k + 1);
+	}
+	level[1 + p] = mask;
+	if(mask >> n & 1)
+	    element = 1;
+	else if(steps[n - 1].attribute && (mask >> (n - 1) & 1))
+	    attribute = 1;
+    }
+
+    if(element) {
+	filter->inside = 1;
+	return 1;
+    }
+    if(attribute) {
+	selected = filter_attributes(data, level, *attr);
+	if(selected != NULL) {
+	    *attr = selected;
+	    level[0] = 1;
+	    return 1;
+	}
+    }
+    return 0;
+}
+
+/*
+ * Pop the level of an element, and tell whether its end is to be
+ * delivered.
+ */
+static int
+filter_end_element(struct expat_parser_data *data)
+{
+    struct expat_path_filter *filter = data->filter;
+    size_t size = filter->level_size * sizeof(uint64_t);
+    int matched = filter->inside > 0;
+
+    if(matched && --filter->inside > 0)
+	return 1;
+
+    /* The level of the document stays */
+    if(filter->levels.len <= size)
+	return matched;
+    filter->levels.len -= size;
+    return matched
+	|| ((uint64_t *) (filter->levels.data + filter->levels.len))[0] != 0;
+}
+
+/*
+ * Element and text dispatch. Some modes need to see every element
+ * boundary, even when no element handler is installed. The dispatchers
+ * below are then installed in expat instead of the handlers in data->c,
+ * which they call. Without an element handler, expat would have given
+ * the tag to the default handler, so they do that.
+ */
+static int
+needs_element_events(struct expat_parser_data *data)
+{
+    return data->coalesce || data->ignore_whitespace || data->filter != NULL
+	|| data->stream;
+}
+
+/*
+ * The number of XML whitespace bytes the len bytes at s start with, 16
+ * bytes at a time when SSE2 is available.
+ */
+static size_t
+whitespace_prefix(const char *s, size_t len)
+{
+    size_t i = 0;
+
+#ifdef __SSE2__
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i lf = _mm_set1_epi8('\n');
+    const __m128i cr = _mm_set1_epi8('\r');
+
+    for(; i + 16 <= len; i += 16) {
+	__m128i v = _mm_loadu_si128((const __m128i *) (s + i));
+	__m128i ws = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, space),
+					       _mm_cmpeq_epi8(v, tab)),
+				  _mm_or_si128(_mm_cmpeq_epi8(v, lf),
+					       _mm_cmpeq_epi8(v, cr)));
+	int mask = _mm_movemask_epi8(ws);
+
+	if(mask != 0xffff)
+	    return i + __builtin_ctz(~mask);
+    }
+#endif
+    for(; i < len; i++) {
+	if(s[i] != ' ' && s[i] != '\t' && s[i] != '\n' && s[i] != '\r')
+	    return i;
+    }
+    return i;
+}
+
+static int
+is_whitespace(const char *s, size_t len)
+{
+    return whitespace_prefix(s, len) == len;
+}
+
+/*
+ * Whether the text being parsed is in an element with mixed content,
+ * where whitespace is kept.
+ */
+static int
+in_mixed_content(struct expat_parser_data *data)
+{
+    size_t depth = data->element_stack.len;
+
+    return depth > 0 && data->element_stack.data[depth - 1];
+}
+
+static void
+deliver_text(struct expat_parser_data *data)
+{
+    size_t len = data->text.len;
+
+    if(len == 0)
+	return;
+    data->text.len = 0;
+    if(data->c.character_data_handler != NULL)
+	data->c.character_data_handler(data, data->text.data, (int) len);
+}
+
+/*
+ * Deliver the character data which has been held back, unless it is
+ * whitespace to suppress. Every C handler of an event which is not
+ * character data calls this first.
+ */
+static void
+flush_text(struct expat_parser_data *data)
+{
+    int is_content = data->text_is_content;
+
+    data->text_is_content = 0;
+    if(data->ignore_whitespace && !is_content && !in_mixed_content(data)
+       && is_whitespace(data->text.data, data->text.len)) {
+	data->text.len = 0;
+	return;
+    }
+    deliver_text(data);
+}
+
+/*
+ * Whether the len bytes at s, given to a handler, are the bytes of the
+ * current event in the input: they are not when references were
+ * replaced, line ends normalized, or the input is not in UTF-8. This
+ * needs the input context of expat, without it only the lengths are
+ * compared.
+ */
+static int
+span_is_verbatim(struct expat_parser_data *data, const char *s, int len)
+{
+    int offset, size;
+    const char *context = XML_GetInputContext(data->parser, &offset, &size);
+
+    if(XML_GetCurrentByteCount(data->parser) != len)
+	return 0;
+    return context == NULL || s == context + offset;
+}
+
+/*
+ * Extend the span of the text held back with the current event, which
+ * is about to be appended to the text.
+ */
+static void
+text_span_append(struct expat_parser_data *data, const char *s, int len)
+{
+    XML_Index start = XML_GetCurrentByteIndex(data->parser);
+    int verbatim = span_is_verbatim(data, s, len);
+
+    if(data->text.len == 0) {
+	data->text_start = start;
+	data->text_verbatim = verbatim;
+    } else {
+	/* Some markup may have been left out in between */
+	data->text_verbatim &= verbatim && start == data->text_end;
+    }
+    data->text_end = start + XML_GetCurrentByteCount(data->parser);
+}
+
+/*
+ * Hold character data back. When coalescing, all of it is, otherwise
+ * only whitespace is, until some text which is not whitespace shows
+ * that the current text is to be delivered.
+ */
+static void
+buffer_character_data(void *user_data, const char *s, int len)
+{
+    struct expat_parser_data *data = user_data;
+
+    /* Outside of the elements matching the path filter */
+    if(data->filter != NULL && data->filter->inside == 0)
+	return;
+
+    if(!data->coalesce && !data->ignore_whitespace) {
+	data->c.character_data_handler(data, s, len);
+	return;
+    }
+
+    if(!data->coalesce) {
+	if(!data->text_is_content && !in_mixed_content(data)
+	   && is_whitespace(s, len)) {
+	    text_span_append(data, s, len);
+	    if(!buffer_append(&data->text, s, len))
+		record_failed(data);
+	    return;
+	}
+	data->text_is_content = 1;
+	deliver_text(data);
+	data->c.character_data_handler(data, s, len);
+	return;
+    }
+
+    text_span_append(data, s, len);
+    if(!buffer_append(&data->text, s, len))
+	record_failed(data);
+}
+
+static void install_handlers(XML_Parser xml_parser,
+			     struct expat_parser_data *data);
+
+static void
+dispatch_start_element(void *user_data, const char *name, const char **attr)
+{
+    struct expat_parser_data *data = user_data;
+    unsigned char mixed = 0;
+
+    flush_text(data);
+    /* The character data handler started skipping the parent */
+    if(data->skip_depth > 0) {
+	data->skip_depth++;
+	return;
+    }
+    if(data->stream)
+	data->stream_depth++;
+    if(data->ignore_whitespace) {
+	if(data->mixed_size > 0) {
+	    intnat symbol = symbols_find(data->symbols, name, strlen(name));
+
+	    mixed = symbol >= 0 && (size_t) symbol < data->mixed_size
+		&& data->mixed[symbol];
+	}
+	if(!buffer_append(&data->element_stack, &mixed, 1))
+	    record_failed(data);
+    }
+    if(data->filter != NULL && !filter_start_element(data, name, &attr))
+	return;
+
+    if(data->c.start_element_handler != NULL)
+	data->c.start_element_handler(user_data, name, attr);
+    else if(data->c.default_handler != NULL)
+	XML_DefaultCurrent(data->parser);
+}
+
+static void
+dispatch_end_element(void *user_data, const char *name)
+{
+    struct expat_parser_data *data = user_data;
+
+    flush_text(data);
+    /* Skipping what is left of this element, that is nothing */
+    if(data->skip_depth > 0) {
+	data->skip_depth = 0;
+	install_handlers(data->parser, data);
+    }
+    /* Suspend expat at the end of a document, see expat_ParseStream */
+    if(data->stream && --data->stream_depth == 0) {
+	data->stream_end = XML_GetCurrentByteIndex(data->parser)
+	    + XML_GetCurrentByteCount(data->parser);
+	XML_StopParser(data->parser, XML_TRUE);
+    }
+    if(data->element_stack.len > 0)
+	data->element_stack.len--;
+    if(data->filter != NULL && !filter_end_element(data))
+	return;
+
+    if(data->c.end_element_handler != NULL)
+	data->c.end_element_handler(user_data, name);
+    else if(data->c.default_handler != NULL)
+	XML_DefaultCurrent(data->parser);
+}
+
+/*
+ * Install the element and character data handlers in expat, taking
+ * the modes into account. Called whenever one of them changes.
+ */
+static void
+install_element_handlers(struct expat_parser_data *data)
+{
+    /* They are installed again once skipping ends */
+    if(data->skip_depth > 0)
+	return;
+
+    if(needs_element_events(data)) {
+	XML_SetElementHandler(data->parser, dispatch_start_element,
+			      dispatch_end_element);
+    } else {
+	XML_SetElementHandler(data->parser, data->c.start_element_handler,
+			      data->c.end_element_handler);
+    }
+    if(needs_element_events(data) && data->c.character_data_handler != NULL) {
+	XML_SetCharacterDataHandler(data->parser, buffer_character_data);
+    } else {
+	XML_SetCharacterDataHandler(data->parser,
+				    data->c.character_data_handler);
+    }
+}
+
+/*
+ * Install the state and the C handlers of a parser, after it has been
+ * created or reset.
+ */
+static void
+install_handlers(XML_Parser xml_parser, struct expat_parser_data *data)
+{
+    XML_SetUserData(xml_parser, data);
+    install_element_handlers(data);
+    XML_SetProcessingInstructionHandler(xml_parser,
+					data->c.processing_instruction_handler);
+    XML_SetCommentHandler(xml_parser, data->c.comment_handler);
+    XML_SetStartCdataSectionHandler(xml_parser, data->c.start_cdata_handler);
+    XML_SetEndCdataSectionHandler(xml_parser, data->c.end_cdata_handler);
+    XML_SetDefaultHandler(xml_parser, data->c.default_handler);
+    XML_SetExternalEntityRefHandler(xml_parser,
+				    data->c.external_entity_ref_handler);
+    XML_SetStartNamespaceDeclHandler(xml_parser,
+				     data->c.start_namespace_decl_handler);
+    XML_SetEndNamespaceDeclHandler(xml_parser,
+				   data->c.end_namespace_decl_handler);
+}
+
+/*
+ * Subtree skipping. Only the element boundaries are seen by the C
+ * stubs, to find the end of the element being skipped, where the
+ * handlers are installed again.
+ */
+static void
+skip_start_element(void *user_data, const char *name, const char **attr)
+{
+    struct expat_parser_data *data = user_data;
+
+    data->skip_depth++;
+}
+
+static void
+skip_end_element(void *user_data, const char *name)
+{
+    struct expat_parser_data *data = user_data;
+
+    if(--data->skip_depth > 0)
+	return;
+
+    /* The end of the skipped element is delivered as usual */
+    install_handlers(data->parser, data);
+    if(needs_element_events(data))
+	dispatch_end_element(data, name);
+    else if(data->c.end_element_handler != NULL)
+	data->c.end_element_handler(data, name);
+    else if(data->c.default_handler != NULL)
+	XML_DefaultCurrent(data->parser);
+}
+
+static void
+install_skip_handlers(XML_Parser xml_parser)
+{
+    XML_SetElementHandler(xml_parser, skip_start_element, skip_end_element);
+    XML_SetCharacterDataHandler(xml_parser, NULL);
+    XML_SetProcessingInstructionHandler(xml_parser, NULL);
+    XML_SetCommentHandler(xml_parser, NULL);
+    XML_SetStartCdataSectionHandler(xml_parser, NULL);
+    XML_SetEndCdataSectionHandler(xml_parser, NULL);
+    XML_SetDefaultHandler(xml_parser, NULL);
+    XML_SetExternalEntityRefHandler(xml_parser, NULL);
+    XML_SetStartNamespaceDeclHandler(xml_parser, NULL);
+    XML_SetEndNamespaceDeclHandler(xml_parser, NULL);
+}
+
+/*
+ * Reset a parser created in an arena. Rather than having expat free
+ * the blocks of the parser one by one, the parser is freed, the arena
+ * emptied at once, and a new parser created in it.
+ */
+static XML_Parser
+arena_parser_reset(struct expat_parser_data *data, const char *encoding)
+{
+    struct expat_memory *saved = expat_current_memory;
+    XML_Bool ok;
+
+    /*
+     * The parsers of external entities use the parser they were created
+     * from, which is then reset in place, and the arena keeps growing.
+     */
+    if(data->memory->children > 0 && data->parser != NULL) {
+	saved = memory_enter(data->parser);
+	ok = XML_ParserReset(data->parser, encoding);
+	memory_leave(saved);
+	if(!ok)
+	    caml_invalid_argument("Expat.parser_reset");
+	return data->parser;
+    }
+
+    expat_current_memory = data->memory;
+    if(data->parser != NULL)
+	XML_ParserFree(data->parser);
+    memory_leave(saved);
+
+    /* Blocks which were not freed may still be in use */
+    if(data->memory->refs == 1)
+	arena_rewind(data->memory->arena);
+
+    data->parser = xml_parser_create(encoding,
+				     data->ns ? data->separator : NULL,
+				     data->memory);
+    return data->parser;
+}
+
+/*
+ * Reset the parser so that it can parse a new document, keeping the
+ * handlers which are installed.
+ */
+static void
+reset_parser(struct expat_parser_data *data, const char *encoding)
+{
+    XML_Parser xml_parser = data->parser;
+    struct expat_memory *saved;
+    XML_Bool ok;
+
+    if(data->memory->arena != NULL) {
+	xml_parser = arena_parser_reset(data, encoding);
+	/* This leaves the parser unusable until reset, see parser_data */
+	if(xml_parser == NULL)
+	    caml_raise_out_of_memory();
+    } else {
+	saved = memory_enter(xml_parser);
+	ok = XML_ParserReset(xml_parser, encoding);
+	memory_leave(saved);
+
+	/* This fails for parsers of external entities */
+	if(!ok) {
+	    caml_invalid_argument("Expat.parser_reset");
+	}
+    }
+
+    data->events.len = 0;
+    data->strings.len = 0;
+    data->text.len = 0;
+    data->text_is_content = 0;
+    data->element_stack.len = 0;
+    data->out_of_memory = 0;
+    data->stopped = 0;
+    data->skip_depth = 0;
+    if(data->filter != NULL)
+	filter_reset(data->filter);
+    data->delivered = 0;
+    data->step_pending = 0;
+    data->step_suspended = 0;
+    data->stream_depth = 0;
+    data->stream_started = 0;
+    data->stream_fed = 0;
+    Store_field(data->handlers, EXPAT_PENDING_EXCEPTION, Val_unit);
+    install_handlers(xml_parser, data);
+}
+
+/*
+ * external parser_reset : expat_parser -> encoding:string option -> unit =
+ *   "expat_XML_ParserReset"
+ */
+CAMLprim value
+expat_XML_ParserReset(value parser, value encoding)
+{
+    CAMLparam2(parser, encoding);
+    struct expat_parser_data *data = Parser_data(parser);
+
+    /* This ends a stream of documents, see expat_ParseStream */
+    data->stream = 0;
+    reset_parser(data, String_option_val(encoding));
+    CAMLreturn (Val_unit);
+}
+
+/*
+ * get_base : expat_parser -> string option
+ */
+CAMLprim value
+expat_XML_GetBase(value parser)
+{
+    CAMLparam1(parser);
+    CAMLlocal1(option);
+    const char *base = NULL;
+
+    base = XML_GetBase(XML_Parser_val(parser));
+    option = Val_option_string(base);
+
+    CAMLreturn (option);
+}
+
+/*
+ * val set_base : expat_parser -> string option -> unit
+ */
+CAMLprim value
+expat_XML_SetBase(value parser, value string)
+{
+    CAMLparam2(parser, string);
+    struct expat_memory *saved = memory_enter(XML_Parser_val(parser));
+
+    XML_SetBase(XML_Parser_val(parser), String_option_val(string));
+    memory_leave(saved);
+
+    CAMLreturn (Val_unit);
+}
+
+/*
+ * external stop : expat_parser -> unit = "expat_Stop"
+ *
+ * Stop parsing the document: no handler is called any more, and the
+ * parse functions return without doing anything until the parser is
+ * reset.
+ */
+CAMLprim value
+expat_Stop(value parser)
+{
+    struct expat_parser_data *data = Parser_data_val(parser);
+
+    data->stopped = 1;
+    if(data->parsing > 0)
+	XML_StopParser(data->parser, XML_FALSE);
+
+    return Val_unit;
+}
+
+/*
+ * external skip_subtree : expat_parser -> unit = "expat_SkipSubtree"
+ *
+ * Skip the rest of the current element. Expat is given handlers which
+ * only count the nested elements, until the end of the current one.
+ */
+CAMLprim value
+expat_SkipSubtree(value parser)
+{
+    struct expat_parser_data *data = Parser_data_val(parser);
+
+    if(data->parsing == 0)
+	caml_invalid_argument("Expat.skip_subtree");
+
+    if(data->skip_depth == 0) {
+	data->skip_depth = 1;
+	install_skip_handlers(data->parser);
+    }
+
+    return Val_unit;
+}
+
+/*
+ * external get_memory_usage : expat_parser -> int = "expat_GetMemoryUsage"
+ */
+CAMLprim value
+expat_GetMemoryUsage(value parser)
+{
+    struct expat_parser_data *data = Parser_data_val(parser);
+
+    /* The blocks allocated from an arena are in its chunks */
+    if(data->memory->arena != NULL)
+	return Val_long(arena_reserved(data->memory->arena));
+    return Val_long(data->memory->usage);
+}
+
+/*
+ * external get_current_byte_index : expat_parser -> int =
+ *   "expat_XML_GetCurrentByteIndex"
+ */
+CAMLprim value
+expat_XML_GetCurrentByteIndex(value parser)
+{
+    return Val_long(XML_GetCurrentByteIndex(XML_Parser_val(parser)));
+}
+
+/*
+ * external get_current_byte_count : expat_parser -> int =
+ *   "expat_XML_GetCurrentByteCount"
+ */
+CAMLprim value
+expat_XML_GetCurrentByteCount(value parser)
+{
+    return Val_long(XML_GetCurrentByteCount(XML_Parser_val(parser)));
+}
+
+/*
+ * external get_current_column_number : expat_parser -> int =
+ *   "expat_XML_GetCurrentColumnNumber"
+ */
+CAMLprim value
+expat_XML_GetCurrentColumnNumber(value parser)
+{
+    return Val_long(XML_GetCurrentColumnNumber(XML_Parser_val(parser)));
+}
+
+/*
+ * external get_current_line_number : expat_parser -> int =
+ *   "expat_XML_GetCurrentLineNumber"
+ */
+CAMLprim value
+expat_XML_GetCurrentLineNumber(value parser)
+{
+    return Val_long(XML_GetCurrentLineNumber(XML_Parser_val(parser)));
+}
+
+/*
+ * external expat_version : unit -> string = "expat_XML_ExpatVersion"
+ */
+CAMLprim value
+expat_XML_ExpatVersion(value unit)
+{
+    return caml_copy_string(XML_ExpatVersion());
+}
+
+/*
+ * external set_param_entity_parsing : expat_parser ->
+ *   xml_param_entity_parsing_choice -> bool =
+ *     "expat_XML_SetParamEntityParsing"
+ */
+CAMLprim value
+expat_XML_SetParamEntityParsing(value parser, value choice) {
+    CAMLparam2(parser, choice);
+    CAMLreturn (Val_bool(XML_SetParamEntityParsing(XML_Parser_val(parser),
+						   Int_val(choice))));
+}
+
+/*
+ * external xml_error_to_string : xml_error -> string = "expat_XML_ErrorString"
+ */
+CAMLprim value
+expat_XML_ErrorString(value error_code)
+{
+    CAMLparam1(error_code);
+    const char *error_string = XML_ErrorString(Int_val(error_code));
+
+    /* XML_ErrorString(XML_ERROR_NONE) returns NULL, this check
+     * will return an empty string whenever this happens. Note:
+     * it checks for NULL, because that is the safest way.
+     */
+    if (error_string == NULL)
+	CAMLreturn (caml_alloc_string(0));
+    CAMLreturn (caml_copy_string(error_string));
+}
+
+/*
+ * Raise an expat_error exception. The exception is looked up on every
+ * call instead of being cached in a static, which would be shared
+ * between domains without synchronisation; this is only done on the
+ * error path anyway.
+ */
+static void
+expat_error(int error_code)
+{
+    const value *expat_error_exn = caml_named_value("expat_error");
+
+    if(expat_error_exn == NULL) {
+	caml_invalid_argument("Exception Expat_error not initialized");
+    }
+
+    caml_raise_with_arg(*expat_error_exn, Val_long(error_code));
+}
+
+/*
+ * Copy the recorded events to a (records, strings) tuple, and empty
+ * the buffers.
+ */
+static value
+take_events(struct expat_parser_data *data)
+{
+    CAMLparam0();
+    CAMLlocal3(events, records, strings);
+
+    records = caml_alloc_initialized_string(data->events.len,
+					    data->events.data);
+    strings = caml_alloc_initialized_string(data->strings.len,
+					    data->strings.data);
+    data->events.len = 0;
+    data->strings.len = 0;
+    data->delivered = 0;
+
+    events = caml_alloc_tuple(2);
+    Store_field(events, 0, records);
+    Store_field(events, 1, strings);
+
+    CAMLreturn (events);
+}
+
+/*
+ * Hand the events recorded in batched event mode to the batch handler.
+ * This is done once per parsed chunk.
+ */
+static void
+flush_events(struct expat_parser_data *data)
+{
+    CAMLparam0();
+    CAMLlocal1(events);
+
+    if(data->events.len > 0
+       && Handler(data, EXPAT_EVENT_BATCH_HANDLER) != Val_unit) {
+	events = take_events(data);
+	caml_callback(Handler(data, EXPAT_EVENT_BATCH_HANDLER), events);
+    }
+    data->events.len = 0;
+    data->strings.len = 0;
+
+    CAMLreturn0;
+}
+
+/*
+ * Called after every call to XML_Parse and XML_ParseBuffer with the
+ * status it returned. Delivers the batched events, and raises an
+ * expat_error when the parse failed.
+ */
+static void
+parse_done(XML_Parser xml_parser, int status)
+{
+    struct expat_parser_data *data = XML_GetUserData(xml_parser);
+    value exn;
+
+    if(data->out_of_memory) {
+	/* The records may be incomplete, drop them */
+	data->out_of_memory = 0;
+	data->events.len = 0;
+	data->strings.len = 0;
+	caml_raise_out_of_memory();
+    }
+
+    memory_report(data->memory);
+
+    exn = Handler(data, EXPAT_PENDING_EXCEPTION);
+    if(exn != Val_unit) {
+	/* A handler raised, expat has been stopped, see handler_result */
+	Store_field(data->handlers, EXPAT_PENDING_EXCEPTION, Val_unit);
+	data->events.len = 0;
+	data->strings.len = 0;
+	caml_raise(exn);
+    }
+
+    /* In pull mode, the events are taken by expat_PullTake instead */
+    if(!data->pull)
+	flush_events(data);
+
+    /* Stopping makes XML_Parse fail with XML_ERROR_ABORTED */
+    if(status == XML_STATUS_ERROR && !data->stopped) {
+	expat_error(XML_GetErrorCode(xml_parser));
+    }
+}
+
+/*
+ * True when parsing does not call back into OCaml, so that the runtime
+ * lock can be released while expat works and other threads can run.
+ * That is the case when no handler other than the batch handler is
+ * installed, batched events are handed to OCaml after expat returns.
+ */
+static int
+parse_without_runtime(struct expat_parser_data *data)
+{
+    int i;
+
+    for(i = 0; i < NUM_HANDLERS; i++) {
+	if(i != EXPAT_EVENT_BATCH_HANDLER && Handler(data, i) != Val_unit)
+	    return 0;
+    }
+    return 1;
+}
+
+/*
+ * XML_Parse and XML_ParseBuffer, billing the memory expat allocates to
+ * the parser, and releasing the runtime lock when that is safe. Unless
+ * unlocked is false, the data passed to xml_parse must not be in the
+ * OCaml heap.
+ */
+static int
+xml_parse(XML_Parser xml_parser, const char *s, int len, int is_final,
+	  int unlocked)
+{
+    struct expat_parser_data *data = XML_GetUserData(xml_parser);
+    struct expat_memory *saved = memory_enter(xml_parser);
+    int status;
+
+    data->parsing++;
+    if(!unlocked || !parse_without_runtime(data)) {
+	status = XML_Parse(xml_parser, s, len, is_final);
+    } else {
+	caml_release_runtime_system();
+	status = XML_Parse(xml_parser, s, len, is_final);
+	caml_acquire_runtime_system();
+    }
+    data->parsing--;
+    memory_leave(saved);
+    return status;
+}
+
+static int
+xml_parse_buffer(XML_Parser xml_parser, int len, int is_final)
+{
+    struct expat_parser_data *data = XML_GetUserData(xml_parser);
+    struct expat_memory *saved = memory_enter(xml_parser);
+    int status;
+
+    data->parsing++;
+    if(!parse_without_runtime(data)) {
+	status = XML_ParseBuffer(xml_parser, len, is_final);
+    } else {
+	caml_release_runtime_system();
+	status = XML_ParseBuffer(xml_parser, len, is_final);
+	caml_acquire_runtime_system();
+    }
+    data->parsing--;
+    memory_leave(saved);
+    return status;
+}
+
+static int
+xml_resume(XML_Parser xml_parser)
+{
+    struct expat_parser_data *data = XML_GetUserData(xml_parser);
+    struct expat_memory *saved = memory_enter(xml_parser);
+    int status;
+
+    data->parsing++;
+    if(!parse_without_runtime(data)) {
+	status = XML_ResumeParser(xml_parser);
+    } else {
+	caml_release_runtime_system();
+	status = XML_ResumeParser(xml_parser);
+	caml_acquire_runtime_system();
+    }
+    data->parsing--;
+    memory_leave(saved);
+    return status;
+}
+
+static void *
+xml_get_buffer(XML_Parser xml_parser, int len)
+{
+    struct expat_memory *saved = memory_enter(xml_parser);
+    void *buf = XML_GetBuffer(xml_parser, len);
+
+    memory_leave(saved);
+    return buf;
+}
+
+/*
+ * XML_Parse takes an int length, so buffers larger than that (mapped
+ * files, mostly) are handed to expat in slices of at most this size.
+ */
+#define EXPAT_MAX_CHUNK (1 << 30)
+
+/*
+ * Let the parser parse len bytes starting at buf, raising an
+ * expat_error when the document is not well-formed. in_heap tells
+ * whether buf points into the OCaml heap.
+ */
+static void
+parse_buffer(XML_Parser xml_parser, const char *buf, uintnat len, int in_heap)
+{
+    struct expat_parser_data *data = XML_GetUserData(xml_parser);
+    void *copy;
+    int status;
+
+    do {
+	int chunk = len > EXPAT_MAX_CHUNK ? EXPAT_MAX_CHUNK : (int) len;
+
+	/* Once stopped, the rest of the document is ignored */
+	if(data->stopped)
+	    return;
+
+	if(!in_heap) {
+	    status = xml_parse(xml_parser, buf, chunk, 0, 1);
+	} else if(chunk > 0 && parse_without_runtime(data)) {
+	    /*
+	     * The heap may move once the runtime lock is released, so copy
+	     * the data to the buffer of the parser first. This is what
+	     * XML_Parse would do anyway.
+	     */
+	    copy = xml_get_buffer(xml_parser, chunk);
+	    if(copy == NULL) {
+		status = XML_STATUS_ERROR;
+	    } else {
+		memcpy(copy, buf, chunk);
+		status = xml_parse_buffer(xml_parser, chunk, 0);
+	    }
+	} else {
+	    status = xml_parse(xml_parser, buf, chunk, 0, 0);
+	}
+	parse_done(xml_parser, status);
+	buf += chunk;
+	len -= chunk;
+    } while(len > 0);
+}
+
+/*
+ * external parse : expat_parser -> string -> unit =  "expat_XML_Parse"
+ */
+CAMLprim value
+expat_XML_Parse(value parser, value string)
+{
+    CAMLparam2(parser, string);
+
+    parse_buffer(XML_Parser_val(parser), String_val(string),
+		 caml_string_length(string), 1);
+
+    CAMLreturn (Val_unit);
+}
+
+/*
+ * external parse_sub : expat_parser -> string -> int -> int -> unit =
+ *   "expat_XML_ParseSub"
+ */
+CAMLprim value
+expat_XML_ParseSub(value vparser, value vstring, value voffset, value vlen)
+{
+    CAMLparam2(vparser, vstring);
+    XML_Parser parser =  XML_Parser_val(vparser);
+    int len = Int_val(vlen);
+    int offset = Int_val(voffset);
+    int string_len = caml_string_length(vstring);
+    char *string = String_val(vstring);
+
+    /* sanity check on the parameters */
+    if((offset < 0) || (len < 0) || (offset > (string_len - len))) {
+	caml_invalid_argument("Expat.parse_sub");
+    }
+
+    parse_buffer(parser, string + offset, len, 1);
+
+    CAMLreturn (Val_unit);
+}
+
+/*
+ * external parse_bigarray_sub : expat_parser -> bigarray -> int -> int ->
+ *   unit = "expat_XML_ParseBigarraySub"
+ *
+ * The data of a bigarray lives outside the OCaml heap, so it is given
+ * to expat as is, without copying it first, even when the runtime lock
+ * is released.
+ */
+CAMLprim value
+expat_XML_ParseBigarraySub(value vparser, value vbuf, value voffset, value vlen)
+{
+    CAMLparam2(vparser, vbuf);
+    XML_Parser parser = XML_Parser_val(vparser);
+    intnat len = Long_val(vlen);
+    intnat offset = Long_val(voffset);
+    intnat buf_len = Caml_ba_array_val(vbuf)->dim[0];
+    char *buf = Caml_ba_data_val(vbuf);
+
+    /* sanity check on the parameters */
+    if((offset < 0) || (len < 0) || (offset > (buf_len - len))) {
+	caml_invalid_argument("Expat.parse_bigarray_sub");
+    }
+
+    parse_buffer(parser, buf + offset, len, 0);
+
+    CAMLreturn (Val_unit);
+}
+
+/*
+ * The size of the blocks read by parse_fd and parse_channel.
+ */
+#define EXPAT_READ_SIZE 65536
+
+/*
+ * external parse_fd : expat_parser -> Unix.file_descr -> unit =
+ *   "expat_XML_ParseFd"
+ *
+ * Read the file descriptor until end of file, directly into the buffer
+ * of the parser. The runtime lock is released while blocked in read(),
+ * so other threads can run.
+ */
+CAMLprim value
+expat_XML_ParseFd(value vparser, value vfd)
+{
+    CAMLparam2(vparser, vfd);
+    XML_Parser parser = XML_Parser_val(vparser);
+    int fd = Int_val(vfd);
+    void *buf;
+    ssize_t n;
+    int err;
+
+    while(!Parser_data_val(vparser)->stopped) {
+	buf = xml_get_buffer(parser, EXPAT_READ_SIZE);
+	if(buf == NULL) {
+	    expat_error(XML_GetErrorCode(parser));
+	}
+
+	caml_release_runtime_system();
+	n = read(fd, buf, EXPAT_READ_SIZE);
+	err = errno;
+	caml_acquire_runtime_system();
+
+	if(n < 0) {
+	    if(err == EINTR) {
+		/* Give signal handlers a chance to run, and try again */
+		caml_process_pending_actions();
+		continue;
+	    }
+	    errno = err;
+	    uerror("read", Nothing);
+	}
+	if(n == 0) {
+	    break;
+	}
+	parse_done(parser, xml_parse_buffer(parser, n, 0));
+    }
+
+    CAMLreturn (Val_unit);
+}
+
+/*
+ * external parse_channel : expat_parser -> in_channel -> unit =
+ *   "expat_XML_ParseChannel"
+ *
+ * Same as parse_fd, but reads from a channel. The channel takes care
+ * of releasing the runtime lock when it has to refill its buffer.
+ */
+CAMLprim value
+expat_XML_ParseChannel(value vparser, value vchannel)
+{
+    CAMLparam2(vparser, vchannel);
+    XML_Parser parser = XML_Parser_val(vparser);
+    struct channel *channel = Channel(vchannel);
+    void *buf;
+    intnat n;
+
+    while(!Parser_data_val(vparser)->stopped) {
+	buf = xml_get_buffer(parser, EXPAT_READ_SIZE);
+	if(buf == NULL) {
+	    expat_error(XML_GetErrorCode(parser));
+	}
+
+	Lock(channel);
+	n = caml_getblock(channel, buf, EXPAT_READ_SIZE);
+	Unlock(channel);
+
+	if(n == 0) {
+	    break;
+	}
+	parse_done(parser, xml_parse_buffer(parser, n, 0));
+    }
+
+    CAMLreturn (Val_unit);
+}
+
+/*
+ * external final : expat_parser -> unit = "expat_XML_Final"
+ */
+CAMLprim value
+expat_XML_Final(value parser)
+{
+    CAMLparam1(parser);
+    XML_Parser xml_parser =  XML_Parser_val(parser);
+
+    if(!Parser_data_val(parser)->stopped)
+	parse_done(xml_parser, xml_parse(xml_parser, NULL, 0, 1, 1));
+
+    CAMLreturn (Val_unit);
+}
+
+/*
+ * external feed : expat_parser -> string -> bool -> unit = "expat_Feed"
+ *
+ * Copy the string to the buffer of the parser, where parse_step will
+ * parse it. The previous input must have been parsed completely.
+ */
+CAMLprim value
+expat_Feed(value parser, value string, value is_final)
+{
+    CAMLparam3(parser, string, is_final);
+    struct expat_parser_data *data = Parser_data_val(parser);
+    mlsize_t len = caml_string_length(string);
+    void *buf;
+
+    if(data->step_pending || data->step_suspended || len > EXPAT_MAX_CHUNK)
+	caml_invalid_argument("Expat.feed");
+
+    buf = xml_get_buffer(data->parser, len);
+    if(buf == NULL) {
+	expat_error(XML_GetErrorCode(data->parser));
+    }
+    memcpy(buf, String_val(string), len);
+    data->step_len = len;
+    data->step_final = Bool_val(is_final);
+    data->step_pending = 1;
+
+    CAMLreturn (Val_unit);
+}
+
+/*
+ * external parse_step : expat_parser -> int -> bool = "expat_ParseStep"
+ *
+ * Parse the input given to feed, or resume parsing it, until
+ * max_events events have been delivered to the handlers. Returns true
+ * when expat was suspended before the end of the input.
+ */
+CAMLprim value
+expat_ParseStep(value parser, value max_events)
+{
+    CAMLparam2(parser, max_events);
+    struct expat_parser_data *data = Parser_data_val(parser);
+    XML_Parser xml_parser = data->parser;
+    int suspend_after = data->suspend_after;
+    int status;
+
+    if(Int_val(max_events) <= 0)
+	caml_invalid_argument("Expat.parse_step");
+    if(data->stopped || !(data->step_pending || data->step_suspended))
+	CAMLreturn (Val_false);
+
+    data->suspend_after = Int_val(max_events);
+    data->delivered = 0;
+    if(data->step_suspended) {
+	status = xml_resume(xml_parser);
+    } else {
+	data->step_pending = 0;
+	status = xml_parse_buffer(xml_parser, data->step_len, data->step_final);
+    }
+    data->suspend_after = suspend_after;
+    data->step_suspended = status == XML_STATUS_SUSPENDED;
+    parse_done(xml_parser, status);
+
+    CAMLreturn (Val_bool(data->step_suspended));
+}
+
+/*
+ * external parse_stream : expat_parser -> string -> bool ->
+ *   (unit -> unit) -> unit = "expat_ParseStream"
+ *
+ * Parse documents which follow each other in the input. The end of a
+ * root element suspends expat, see dispatch_end_element, and once
+ * document_end has been called, the parser is reset to parse what
+ * follows in the same string, from the first byte which is not
+ * whitespace: an XML declaration must start the document.
+ */
+CAMLprim value
+expat_ParseStream(value parser, value string, value is_final,
+		  value document_end)
+{
+    CAMLparam4(parser, string, is_final, document_end);
+    struct expat_parser_data *data = Parser_data_val(parser);
+    mlsize_t len = caml_string_length(string), pos = 0;
+    int chunk, status, stopped;
+
+    if(data->pull || data->step_pending || data->step_suspended)
+	caml_invalid_argument("Expat.parse_stream");
+    if(!data->stream) {
+	data->stream = 1;
+	install_element_handlers(data);
+    }
+
+    while(pos < len && !data->stopped) {
+	if(!data->stream_started) {
+	    pos += whitespace_prefix(String_val(string) + pos, len - pos);
+	    if(pos == len)
+		break;
+	    data->stream_started = 1;
+	}
+
+	chunk = len - pos > EXPAT_MAX_CHUNK ? EXPAT_MAX_CHUNK : (int) (len - pos);
+	data->stream_end = -1;
+	status = xml_parse(data->parser, String_val(string) + pos, chunk, 0, 0);
+	parse_done(data->parser, status);
+	if(data->stream_end < 0) {
+	    data->stream_fed += chunk;
+	    pos += chunk;
+	    continue;
+	}
+
+	/* What expat was given after the end of the document is dropped */
+	pos += data->stream_end - data->stream_fed;
+	/* Stopping at the end of the root element stops the stream too */
+	stopped = data->stopped;
+	reset_parser(data, data->encoding);
+	if(stopped) {
+	    data->stopped = 1;
+	    break;
+	}
+	caml_callback(document_end, Val_unit);
+    }
+
+    if(Bool_val(is_final) && data->stream_started && !data->stopped)
+	parse_done(data->parser, xml_parse(data->parser, NULL, 0, 1, 0));
+
+    CAMLreturn (Val_unit);
+}
+
+/*
+ * The attributes given by expat as an assoc list.
+ */
+static value
+attribute_list(const char **attr)
+{
+    CAMLparam0();
+    CAMLlocal5(list, cons, prev, att, str);
+    int i;
+
+    list = Val_unit;
+    prev = Val_unit;
+
+    for(i = 0; attr[i]; i += 2) {
+	/* Create a tuple */
+	att = caml_alloc_tuple(2);
+	str = caml_copy_string(attr[i]);
+	Store_field(att, 0, str);
+	str = caml_copy_string(attr[i + 1]);
+	Store_field(att, 1, str);
+
+	/* Create a cons */
+	cons = caml_alloc_tuple(2);
+	Store_field(cons, 0, att);
+	Store_field(cons, 1, Val_unit);
+	if(prev != Val_unit) {
+	    Store_field(prev, 1, cons);
+	}
+	prev = cons;
+	if(list == Val_unit) {
+	    list = cons;
+	}
+    }
+    CAMLreturn (list);
+}
+
+/*
+ * Start element handling, setting and resetting.
+ */
+static void
+start_element_handler(void *user_data, const char *name, const char **attr)
+{
+    CAMLparam0();
+    CAMLlocal2(list, tag);
+    struct expat_parser_data *data = user_data;
+
+    if(handlers_stopped(data))
+	CAMLreturn0;
+
+    list = attribute_list(attr);
+    tag = caml_copy_string(name);
+    handler_result(data, caml_callback2_exn(Handler(data,
+						    EXPAT_START_ELEMENT_HANDLER),
+					    tag, list));
+
+    CAMLreturn0;
+}
+
+static value set_start_handler(value parser,
+			       XML_StartElementHandler c_handler,
+			       value ocaml_handler)
+{
+    CAMLparam2(parser, ocaml_handler);
+    XML_Parser xml_parser = XML_Parser_val(parser);
+    struct expat_parser_data *data = XML_GetUserData(xml_parser);
+
+    Store_field(data->handlers, EXPAT_START_ELEMENT_HANDLER, ocaml_handler);
+    data->c.start_element_handler = c_handler;
+    install_element_handlers(data);
+
+    CAMLreturn (Val_unit);
+}
+
+/*
+ * external set_start_element_handler : expat_parser ->
+ *  (string -> (string * string) list -> unit) -> unit =
+ *   "expat_XML_SetStartElementHandler"
+ */
+CAMLprim value
+expat_XML_SetStartElementHandler(value parser, value handler)
+{
+    CAMLparam2(parser, handler);
+    CAMLreturn (set_start_handler(parser, start_element_handler, handler));
+}
+
+/*
+ * external reset_start_element_handler : expat_parser -> unit =
+ *   "expat_XML_ResetStartElementHandler"
+ */
+CAMLprim value
+expat_XML_ResetStartElementHandler(value parser)
+{
+    CAMLparam1(parser);
+    CAMLreturn (set_start_handler(parser, NULL, Val_unit));
+}
+
+/*
+ * Lazy start element handling. The OCaml handler is given the name of
+ * the element, or its symbol, and an attributes block through which it
+ * reads the attributes it needs. The block is allocated once, when the
+ * handler is set, and points to the attributes of expat and to the
+ * parser state during the callback only. The slot of the handler holds
+ * a (handler, attributes) pair.
+ */
+struct expat_attributes {
+    const char **attr;
+    struct expat_parser_data *data;
+};
+
+#define Attributes_val(v) ((struct expat_attributes *) Data_abstract_val(v))
+
+/*
+ * Call the lazy start element handler with the attributes. When ns is
+ * not Val_unit, the handler takes the namespace as first argument.
+ */
+static void
+call_lazy_start_handler(struct expat_parser_data *data, value ns, value tag,
+			const char **attr)
+{
+    CAMLparam2(ns, tag);
+    CAMLlocal3(handler, attributes, result);
+    struct expat_attributes saved;
+
+    if(handlers_stopped(data))
+	CAMLreturn0;
+
+    attributes = Field(Handler(data, EXPAT_START_ELEMENT_HANDLER), 1);
+
+    /*
+     * The handler may parse with a parser of an external entity, which
+     * shares the attributes block.
+     */
+    saved = *Attributes_val(attributes);
+    Attributes_val(attributes)->attr = attr;
+    Attributes_val(attributes)->data = data;
+    handler = Field(Handler(data, EXPAT_START_ELEMENT_HANDLER), 0);
+    if(ns == Val_unit)
+	result = caml_callback2_exn(handler, tag, attributes);
+    else
+	result = caml_callback3_exn(handler, ns, tag, attributes);
+    *Attributes_val(attributes) = saved;
+    handler_result(data, result);
+
+    CAMLreturn0;
+}
+
+static void
+lazy_start_element_handler(void *user_data, const char *name,
+			   const char **attr)
+{
+    call_lazy_start_handler(user_data, Val_unit, caml_copy_string(name), attr);
+}
+
+/*
+ * The symbol of a name, for attribute_symbol.
+ */
+static value
+symbol_val(struct expat_parser_data *data, const char *name)
+{
+    intnat symbol = intern_name(data, name, strlen(name));
+
+    if(symbol < 0)
+	caml_raise_out_of_memory();
+    return Val_long(symbol);
+}
+
+/*
+ * Out_of_memory must not be raised through expat from the handlers
+ * taking symbols: when a name cannot be interned, expat is stopped with
+ * record_failed instead, and parse_done raises it.
+ */
+static void
+symbol_start_element_handler(void *user_data, const char *name,
+			     const char **attr)
+{
+    intnat symbol = intern_name(user_data, name, strlen(name));
+
+    if(symbol < 0) {
+	record_failed(user_data);
+	return;
+    }
+    call_lazy_start_handler(user_data, Val_unit, Val_long(symbol), attr);
+}
+
+/*
+ * The local part of a name given by a parser created with
+ * parser_create_ns, which is "uri<separator>local" for a name in a
+ * namespace. *ns is set to the symbol of the namespace URI, or -1.
+ * Returns NULL when out of memory, without raising, as for
+ * symbol_start_element_handler.
+ */
+static const char *
+split_name(struct expat_parser_data *data, const char *name, value *ns)
+{
+    const char *local = data->ns ? strrchr(name, data->separator[0]) : NULL;
+    intnat symbol;
+
+    if(local == NULL) {
+	*ns = Val_long(-1);
+	return name;
+    }
+    symbol = intern_name(data, name, local - name);
+    if(symbol < 0)
+	return NULL;
+    *ns = Val_long(symbol);
+    return local + 1;
+}
+
+static void
+ns_start_element_handler(void *user_data, const char *name,
+			 const char **attr)
+{
+    value ns;
+    const char *local = split_name(user_data, name, &ns);
+
+    if(local == NULL) {
+	record_failed(user_data);
+	return;
+    }
+    call_lazy_start_handler(user_data, ns, caml_copy_string(local), attr);
+}
+
+static value
+set_lazy_start_handler(value parser, XML_StartElementHandler c_handler,
+		       value handler)
+{
+    CAMLparam2(parser, handler);
+    CAMLlocal2(attributes, pair);
+
+    attributes = caml_alloc_small(Wsize_bsize(sizeof(struct expat_attributes)),
+				  Abstract_tag);
+    Attributes_val(attributes)->attr = NULL;
+    Attributes_val(attributes)->data = NULL;
+    pair = caml_alloc_tuple(2);
+    Store_field(pair, 0, handler);
+    Store_field(pair, 1, attributes);
+
+    CAMLreturn (set_start_handler(parser, c_handler, pair));
+}
+
+/*
+ * external set_start_element_handler_lazy : expat_parser ->
+ *  (string -> attributes -> unit) -> unit =
+ *   "expat_SetStartElementHandlerLazy"
+ */
+CAMLprim value
+expat_SetStartElementHandlerLazy(value parser, value handler)
+{
+    return set_lazy_start_handler(parser, lazy_start_element_handler, handler);
+}
+
+/*
+ * external set_start_element_handler_ns : expat_parser ->
+ *  (int -> string -> attributes -> unit) -> unit =
+ *   "expat_SetStartElementHandlerNS"
+ */
+CAMLprim value
+expat_SetStartElementHandlerNS(value parser, value handler)
+{
+    return set_lazy_start_handler(parser, ns_start_element_handler, handler);
+}
+
+/*
+ * external set_start_element_handler_sym : expat_parser ->
+ *  (int -> attributes -> unit) -> unit =
+ *   "expat_SetStartElementHandlerSym"
+ */
+CAMLprim value
+expat_SetStartElementHandlerSym(value parser, value handler)
+{
+    return set_lazy_start_handler(parser, symbol_start_element_handler,
+				  handler);
+}
+
+static const char **
+attributes_get(value attributes)
+{
+    const char **attr = Attributes_val(attributes)->attr;
+
+    if(attr == NULL)
+	caml_invalid_argument("Expat.attributes");
+    return attr;
+}
+
+/*
+ * external attributes_length : attributes -> int =
+ *   "expat_AttributesLength"
+ */
+CAMLprim value
+expat_AttributesLength(value attributes)
+{
+    const char **attr = attributes_get(attributes);
+    intnat n = 0;
+
+    while(attr[2 * n] != NULL)
+	n++;
+    return Val_long(n);
+}
+
+static const char *
+attribute_nth(value attributes, value index, int field)
+{
+    const char **attr = attributes_get(attributes);
+    intnat i, n = Long_val(index);
+
+    if(n < 0)
+	caml_invalid_argument("index out of bounds");
+    for(i = 0; i <= n; i++) {
+	if(attr[2 * i] == NULL)
+	    caml_invalid_argument("index out of bounds");
+    }
+    return attr[2 * n + field];
+}
+
+/*
+ * external attribute_name : attributes -> int -> string =
+ *   "expat_AttributeName"
+ */
+CAMLprim value
+expat_AttributeName(value attributes, value index)
+{
+    return caml_copy_string(attribute_nth(attributes, index, 0));
+}
+
+/*
+ * external attribute_value : attributes -> int -> string =
+ *   "expat_AttributeValue"
+ */
+CAMLprim value
+expat_AttributeValue(value attributes, value index)
+{
+    return caml_copy_string(attribute_nth(attributes, index, 1));
+}
+
+/*
+ * external find_attribute : attributes -> string -> string option =
+ *   "expat_FindAttribute"
+ */
+CAMLprim value
+expat_FindAttribute(value attributes, value name)
+{
+    CAMLparam2(attributes, name);
+    const char **attr = attributes_get(attributes);
+    int i;
+
+    for(i = 0; attr[i] != NULL; i += 2) {
+	if(caml_string_length(name) == strlen(attr[i])
+	   && memcmp(String_val(name), attr[i], caml_string_length(name)) == 0)
+	    CAMLreturn (caml_alloc_some(caml_copy_string(attr[i + 1])));
+    }
+
+    CAMLreturn (Val_none);
+}
+
+/*
+ * external attribute_symbol : attributes -> int -> int =
+ *   "expat_AttributeSymbol"
+ */
+CAMLprim value
+expat_AttributeSymbol(value attributes, value index)
+{
+    const char *name = attribute_nth(attributes, index, 0);
+
+    return symbol_val(Attributes_val(attributes)->data, name);
+}
+
+/*
+ * external attribute_namespace : attributes -> int -> int =
+ *   "expat_AttributeNamespace"
+ */
+CAMLprim value
+expat_AttributeNamespace(value attributes, value index)
+{
+    value ns;
+
+    if(split_name(Attributes_val(attributes)->data,
+		  attribute_nth(attributes, index, 0), &ns) == NULL)
+	caml_raise_out_of_memory();
+    return ns;
+}
+
+/*
+ * external attribute_local_name : attributes -> int -> string =
+ *   "expat_AttributeLocalName"
+ */
+CAMLprim value
+expat_AttributeLocalName(value attributes, value index)
+{
+    value ns;
+    const char *local = split_name(Attributes_val(attributes)->data,
+				   attribute_nth(attributes, index, 0), &ns);
+
+    if(local == NULL)
+	caml_raise_out_of_memory();
+    return caml_copy_string(local);
+}
+
+/*
+ * external intern : expat_parser -> string -> int = "expat_Intern"
+ */
+CAMLprim value
+expat_Intern(value parser, value name)
+{
+    struct expat_parser_data *data = Parser_data_val(parser);
+    intnat symbol;
+
+    if(!caml_string_is_c_safe(name))
+	caml_invalid_argument("Expat.intern");
+    symbol = symbols_intern(symbols_get(data), String_val(name),
+			    caml_string_length(name));
+    if(symbol < 0)
+	caml_raise_out_of_memory();
+    return Val_long(symbol);
+}
+
+/*
+ * external symbol_name : expat_parser -> int -> string = "expat_SymbolName"
+ */
+CAMLprim value
+expat_SymbolName(value parser, value symbol)
+{
+    struct expat_symbols *symbols = symbols_get(Parser_data_val(parser));
+
+    if(Long_val(symbol) < 0 || Long_val(symbol) >= (intnat) symbols->count)
+	caml_invalid_argument("Expat.symbol_name");
+    return caml_copy_string(symbols->names[Long_val(symbol)]);
+}
+
+static void
+end_element_handler(void *user_data, const char *name)
+{
+    value tag;
+    struct expat_parser_data *data = user_data;
+
+    if(handlers_stopped(data))
+	return;
+
+    tag = caml_copy_string(name);
+    handler_result(data, caml_callback_exn(Handler(data,
+						   EXPAT_END_ELEMENT_HANDLER),
+					   tag));
+}
+
+
+static value
+set_end_handler(value parser, XML_EndElementHandler c_handler,
+		value ocaml_handler)
+{
+    CAMLparam2(parser, ocaml_handler);
+    XML_Parser xml_parser = XML_Parser_val(parser);
+    struct expat_parser_data *data = XML_GetUserData(xml_parser);
+
+    Store_field(data->handlers, EXPAT_END_ELEMENT_HANDLER, ocaml_handler);
+    data->c.end_element_handler = c_handler;
+    install_element_handlers(data);
+
+    CAMLreturn (Val_unit);
+}
+
+/*
+ * external set_end_element_handler : expat_parser -> (string -> unit) -> unit =
+ *   "expat_XML_SetEndElementHandler"
+ */
+CAMLprim value
+expat_XML_SetEndElementHandler(value parser, value handler)
+{
+    CAMLparam2(parser, handler);
+    CAMLreturn (set_end_handler(parser, end_element_handler, handler));
+}
+
+/*
+ * external reset_end_element_handler : expat_parser -> unit =
+ *   "expat_XML_ResetEndElementHandler"
+ */
+CAMLprim value
+expat_XML_ResetEndElementHandler(value parser)
+{
+    CAMLparam1(parser);
+    CAMLreturn (set_end_handler(parser, NULL, Val_unit));
+}
+
+static void
+symbol_end_element_handler(void *user_data, const char *name)
+{
+    struct expat_parser_data *data = user_data;
+    intnat symbol;
+
+    if(handlers_stopped(data))
+	return;
+
+    /* See symbol_start_element_handler */
+    symbol = intern_name(data, name, strlen(name));
+    if(symbol < 0) {
+	record_failed(data);
+	return;
+    }
+    handler_result(data, caml_callback_exn(Handler(data,
+						   EXPAT_END_ELEMENT_HANDLER),
+					   Val_long(symbol)));
+}
+
+
+static void
+ns_end_element_handler(void *user_data, const char *name)
+{
+    CAMLparam0();
+    CAMLlocal2(ns, local);
+    struct expat_parser_data *data = user_data;
+    const char *s;
+
+    if(handlers_stopped(data))
+	CAMLreturn0;
+
+    s = split_name(data, name, &ns);
+    if(s == NULL) {
+	record_failed(data);
+	CAMLreturn0;
+    }
+    local = caml_copy_string(s);
+    handler_result(data, caml_callback2_exn(Handler(data,
+						    EXPAT_END_ELEMENT_HANDLER),
+					    ns, local));
+
+    CAMLreturn0;
+}
+
+/*
+ * external set_end_element_handler_ns : expat_parser ->
+ *   (int -> string -> unit) -> unit = "expat_SetEndElementHandlerNS"
+ */
+CAMLprim value
+expat_SetEndElementHandlerNS(value parser, value handler)
+{
+    CAMLparam2(parser, handler);
+    CAMLreturn (set_end_handler(parser, ns_end_element_handler, handler));
+}
+
+/*
+ * external set_end_element_handler_sym : expat_parser -> (int -> unit) ->
+ *   unit = "expat_SetEndElementHandlerSym"
+ */
+CAMLprim value
+expat_SetEndElementHandlerSym(value parser, value handler)
+{
+    CAMLparam2(parser, handler);
+    CAMLreturn (set_end_handler(parser, symbol_end_element_handler, handler));
+}
+
+/*
+ * The handlers taking a substring of a scratch buffer, which is reused
+ * from one call to the next. The slot of such a handler holds a
+ * (handler, scratch) pair, the scratch bytes are replaced with larger
+ * ones when some text does not fit, so that no allocation is done once
+ * the scratch has grown to the size of the largest text.
+ */
+#define EXPAT_SCRATCH_SIZE 4096
+
+static value
+alloc_sub_handler(value handler)
+{
+    CAMLparam1(handler);
+    CAMLlocal2(scratch, pair);
+
+    scratch = caml_alloc_string(EXPAT_SCRATCH_SIZE);
+    pair = caml_alloc_tuple(2);
+    Store_field(pair, 0, handler);
+    Store_field(pair, 1, scratch);
+
+    CAMLreturn (pair);
+}
+
+static void
+call_sub_handler(struct expat_parser_data *data, int handler, const char *s,
+		 int len)
+{
+    CAMLparam0();
+    CAMLlocal2(pair, scratch);
+    mlsize_t size;
+
+    if(handlers_stopped(data))
+	CAMLreturn0;
+
+    pair = Handler(data, handler);
+    scratch = Field(pair, 1);
+    size = caml_string_length(scratch);
+    if(size < (mlsize_t) len) {
+	while(size < (mlsize_t) len)
+	    size *= 2;
+	scratch = caml_alloc_string(size);
+	Store_field(pair, 1, scratch);
+    }
+    memcpy(Bytes_val(scratch), s, len);
+    handler_result(data, caml_callback3_exn(Field(pair, 0), scratch,
+					    Val_int(0), Val_int(len)));
+
+    CAMLreturn0;
+}
+
+/*
+ * external set_character_data_coalescing : expat_parser -> bool -> unit =
+ *   "expat_SetCharacterDataCoalescing"
+ */
+CAMLprim value
+expat_SetCharacterDataCoalescing(value parser, value coalesce)
+{
+    CAMLparam2(parser, coalesce);
+    struct expat_parser_data *data = Parser_data_val(parser);
+
+    flush_text(data);
+    data->coalesce = Bool_val(coalesce);
+    install_element_handlers(data);
+
+    CAMLreturn (Val_unit);
+}
+
+/*
+ * external set_ignore_whitespace : expat_parser -> bool -> unit =
+ *   "expat_SetIgnoreWhitespace"
+ */
+CAMLprim value
+expat_SetIgnoreWhitespace(value parser, value ignore)
+{
+    CAMLparam2(parser, ignore);
+    struct expat_parser_data *data = Parser_data_val(parser);
+
+    flush_text(data);
+    /*
+     * The stack only has the elements opened while whitespace was
+     * ignored. It is emptied, so that the elements open now are popped
+     * from an empty stack and taken as not mixed.
+     */
+    if(data->ignore_whitespace != Bool_val(ignore))
+	data->element_stack.len = 0;
+    data->ignore_whitespace = Bool_val(ignore);
+    install_element_handlers(data);
+
+    CAMLreturn (Val_unit);
+}
+
+/*
+ * external set_mixed_content_elements : expat_parser -> string list ->
+ *   unit = "expat_SetMixedContentElements"
+ */
+CAMLprim value
+expat_SetMixedContentElements(value parser, value names)
+{
+    CAMLparam2(parser, names);
+    CAMLlocal1(l);
+    struct expat_parser_data *data = Parser_data_val(parser);
+    struct expat_symbols *symbols = symbols_get(data);
+    unsigned char *mixed;
+    intnat symbol;
+
+    for(l = names; l != Val_emptylist; l = Field(l, 1)) {
+	if(!caml_string_is_c_safe(Field(l, 0)))
+	    caml_invalid_argument("Expat.set_mixed_content_elements");
+	symbol = symbols_intern(symbols, String_val(Field(l, 0)),
+				caml_string_length(Field(l, 0)));
+	if(symbol < 0)
+	    caml_raise_out_of_memory();
+    }
+
+    mixed = calloc(symbols->count ? symbols->count : 1, 1);
+    if(mixed == NULL)
+	caml_raise_out_of_memory();
+    for(l = names; l != Val_emptylist; l = Field(l, 1)) {
+	mixed[symbols_find(symbols, String_val(Field(l, 0)),
+			   caml_string_length(Field(l, 0)))] = 1;
+    }
+    free(data->mixed);
+    data->mixed = mixed;
+    data->mixed_size = names == Val_emptylist ? 0 : symbols->count;
+
+    CAMLreturn (Val_unit);
+}
+
+/*
+ * Compile a path of the given length into steps, starting at *n, which
+ * is moved past them. Returns 0 when the path is invalid, and -1 when
+ * out of memory.
+ */
+static int
+compile_path(struct expat_symbols *symbols, const char *path, size_t len,
+	     struct expat_path_step *steps, size_t *n)
+{
+    struct expat_path_step *step;
+    size_t i = 0, start, end, first = *n;
+
+    if(len == 0 || path[0] != '/')
+	return 0;
+
+    while(i < len) {
+	step = &steps[(*n)++];
+	step->descendant = i + 1 < len && path[i + 1] == '/';
+	start = i + 1 + step->descendant;
+	for(end = start; end < len && path[end] != '/'; end++)
+	    ;
+	step->attribute = end > start && path[start] == '@';
+	if(step->attribute)
+	    start++;
+	/* An attribute can only be tested by the last step */
+	if(end == start || (step->attribute && end < len))
+	    return 0;
+	step->any = end - start == 1 && path[start] == '*';
+	if(!step->any) {
+	    step->name = symbols_intern(symbols, path + start, end - start);
+	    if(step->name < 0)
+		return -1;
+	}
+	i = end;
+    }
+
+    return *n - first <= EXPAT_MAX_PATH_STEPS;
+}
+
+/*
+ * external set_path_filter : expat_parser -> string list -> unit =
+ *   "expat_SetPathFilter"
+ */
+CAMLprim value
+expat_SetPathFilter(value parser, value paths)
+{
+    CAMLparam2(parser, paths);
+    CAMLlocal1(l);
+    struct expat_parser_data *data = Parser_data_val(parser);
+    struct expat_symbols *symbols = symbols_get(data);
+    struct expat_path_filter *filter = NULL;
+    size_t num_paths = 0, num_steps = 0, n = 0, p = 0, i;
+    int ok = 1;
+
+    for(l = paths; l != Val_emptylist; l = Field(l, 1)) {
+	if(!caml_string_is_c_safe(Field(l, 0)))
+	    caml_invalid_argument("Expat.set_path_filter");
+	/* Each step starts with a slash */
+	for(i = 0; i < caml_string_length(Field(l, 0)); i++)
+	    num_steps += String_val(Field(l, 0))[i] == '/';
+	num_paths++;
+    }
+
+    if(num_paths > 0) {
+	filter = calloc(1, sizeof *filter);
+	if(filter == NULL)
+	    caml_raise_out_of_memory();
+	filter->num_paths = num_paths;
+	filter->level_size = num_paths + 1;
+	filter->first = malloc((num_paths + 1) * sizeof *filter->first);
+	filter->steps = malloc((num_steps ? num_steps : 1)
+			       * sizeof *filter->steps);
+	if(filter->first == NULL || filter->steps == NULL
+	   || !buffer_reserve(&filter->levels,
+			      filter->level_size * sizeof(uint64_t)))
+	    ok = -1;
+	for(l = paths; ok > 0 && l != Val_emptylist; l = Field(l, 1)) {
+	    filter->first[p++] = n;
+	    ok = compile_path(symbols, String_val(Field(l, 0)),
+			      caml_string_length(Field(l, 0)),
+			      filter->steps, &n);
+	}
+	if(ok <= 0) {
+	    filter_free(filter);
+	    if(ok < 0)
+		caml_raise_out_of_memory();
+	    caml_invalid_argument("Expat.set_path_filter");
+	}
+	filter->first[num_paths] = n;
+	filter_reset(filter);
+    }
+
+    flush_text(data);
+    filter_free(data->filter);
+    data->filter = filter;
+    install_element_handlers(data);
+
+    CAMLreturn (Val_unit);
+}
+
+/*
+ * Character data handling, setting, and resetting
+ */
+static void
+character_data_handler(void *user_data, const char *s, int len)
+{
+    CAMLparam0();
+    CAMLlocal1(str);
+    struct expat_parser_data *data = user_data;
+    value handler;
+
+    if(handlers_stopped(data))
+	CAMLreturn0;
+
+    str = caml_alloc_string(len);
+    memcpy(String_val(str), s, len);
+    handler = Handler(data, EXPAT_CHARACTER_DATA_HANDLER);
+    handler_result(data, caml_callback_exn(handler, str));
+
+    CAMLreturn0;
+}
+
+static value set_character_data_handler(value parser,
+					XML_CharacterDataHandler c_handler,
+					value ocaml_handler)
+{
+    CAMLparam2(parser, ocaml_handler);
+    XML_Parser xml_parser = XML_Parser_val(parser);
+    struct expat_parser_data *data = XML_GetUserData(xml_parser);
+
+    Store_field(data->handlers, EXPAT_CHARACTER_DATA_HANDLER, ocaml_handler);
+    data->c.character_data_handler = c_handler;
+    install_element_handlers(data);
+
+    CAMLreturn (Val_unit);
+}
+
+
+/*
+ * external set_character_data_handler : expat_parser -> (string -> unit) -> unit =
+ *   "expat_XML_SetCharacterDataHandler"
+ */
+CAMLprim value
+expat_XML_SetCharacterDataHandler(value parser, value handler)
+{
+    CAMLparam2(parser, handler);
+    CAMLreturn (set_character_data_handler(parser, character_data_handler,
+					   handler));
+}
+
+static void
+character_data_handler_sub(void *user_data, const char *s, int len)
+{
+    struct expat_parser_data *data = user_data;
+
+    call_sub_handler(data, EXPAT_CHARACTER_DATA_HANDLER, s, len);
+}
+
+/*
+ * external set_character_data_handler_sub : expat_parser ->
+ *   (bytes -> int -> int -> unit) -> unit =
+ *     "expat_SetCharacterDataHandlerSub"
+ */
+CAMLprim value
+expat_SetCharacterDataHandlerSub(value parser, value handler)
+{
+    CAMLparam2(parser, handler);
+    CAMLlocal1(pair);
+
+    pair = alloc_sub_handler(handler);
+    CAMLreturn (set_character_data_handler(parser, character_data_handler_sub,
+					   pair));
+}
+
+/*
+ * external reset_end_element_handler : expat_parser -> unit =
+ *   "expat_XML_ResetEndElementHandler"
+ */
+CAMLprim value
+expat_XML_ResetCharacterDataHandler(value parser)
+{
+    CAMLparam1(parser);
+    CAMLreturn (set_character_data_handler(parser, NULL, Val_unit));
+}
+
+/*
+ * Process instruction, setting and resetting
+ */
+static void
+processing_instruction_handler(void *user_data,  const char *target,
+			       const char *s)
+{
+    CAMLparam0();
+    CAMLlocal2(t, d);
+    struct expat_parser_data *data = user_data;
+    value handler;
+
+    if(handlers_stopped(data))
+	CAMLreturn0;
+
+    flush_text(data);
+
+    t = caml_copy_string(target);
+    d = caml_copy_string(s);
+    handler = Handler(data, EXPAT_PROCESSING_INSTRUCTION_HANDLER);
+    handler_result(data, caml_callback2_exn(handler, t, d));
+
+    CAMLreturn0;
+}
+
+static value
+set_processing_instruction_handler(value parser,
+				   XML_ProcessingInstructionHandler c_handler,
+				   value ocaml_handler)
+{
+    CAMLparam2(parser, ocaml_handler);
+    XML_Parser xml_parser = XML_Parser_val(parser);
+    struct expat_parser_data *data = XML_GetUserData(xml_parser);
+
+    Store_field(data->handlers,
+		EXPAT_PROCESSING_INSTRUCTION_HANDLER, ocaml_handler);
+    data->c.processing_instruction_handler = c_handler;
+    if(data->skip_depth == 0)
+	XML_SetProcessingInstructionHandler(xml_parser, c_handler);
+
+    CAMLreturn (Val_unit);
+}
+
+/*
+ * external set_processing_instruction_handler : expat_parser ->
+ *   (string -> string -> unit) -> unit =
+ *      "expat_XML_SetProcessingInstructionHandler"
+ */
+CAMLprim value
+expat_XML_SetProcessingInstructionHandler(value parser, value handler)
+{
+    CAMLparam2(parser, handler);
+    CAMLreturn (set_processing_instruction_handler(parser,
+						   processing_instruction_handler,
+						   handler));
+}
+
+/*
+ * external reset_processing_instruction_handler : expat_parser -> unit =
+ *   "expat_XML_ResetProcessingInstructionHandler"
+ */
+CAMLprim value
+expat_XML_ResetProcessingInstructionHandler(value parser)
+{
+    CAMLparam1(parser);
+    CAMLreturn (set_processing_instruction_handler(parser, NULL, Val_unit));
+}
+
+/*
+ * Comment handler, setting and resetting
+ */
+static void
+comment_handler(void *user_data, const char *s)
+{
+    CAMLparam0();
+    CAMLlocal1(d);
+    struct expat_parser_data *data = user_data;
+    value handler;
+
+    if(handlers_stopped(data))
+	CAMLreturn0;
+
+    flush_text(data);
+    d = caml_copy_string(s);
+    handler = Handler(data, EXPAT_COMMENT_HANDLER);
+    handler_result(data, caml_callback_exn(handler, d));
+
+    CAMLreturn0;
+}
+
+static value
+set_comment_handler(value parser,
+		    XML_CommentHandler c_handler, value ocaml_handler)
+{
+    CAMLparam2(parser, ocaml_handler);
+    XML_Parser xml_parser = XML_Parser_val(parser);
+    struct expat_parser_data *data = XML_GetUserData(xml_parser);
+
+    Store_field(data->handlers, EXPAT_COMMENT_HANDLER, ocaml_handler);
+    data->c.comment_handler = c_handler;
+    if(data->skip_depth == 0)
+	XML_SetCommentHandler(xml_parser, c_handler);
+
+    CAMLreturn (Val_unit);
+}
+
+/*
+ * external set_comment_handler : expat_parser -> (string -> unit) -> unit =
+ *   "expat_XML_SetCommentHandler"
+ */
+CAMLprim value
+expat_XML_SetCommentHandler(value parser, value handler)
+{
+    CAMLparam2(parser, handler);
+    CAMLreturn (set_comment_handler(parser, comment_handler, handler));
+}
+
+/*
+ * external reset_comment_handler : expat_parser -> unit =
+ *   "expat_XML_ResetCommentHandler"
+ */
+CAMLprim value
+expat_XML_ResetCommentHandler(value parser)
+{
+    CAMLparam1(parser);
+    CAMLreturn (set_comment_handler(parser, NULL, Val_unit));
+}
+
+/*
+ * Start CData handler, setting and resetting
+ */
+static void
+start_cdata_handler(void *user_data)
+{
+    CAMLparam0();
+    struct expat_parser_data *data = user_data;
+    value handler;
+
+    if(handlers_stopped(data))
+	CAMLreturn0;
+
+    flush_text(data);
+
+    handler = Handler(data, EXPAT_START_CDATA_HANDLER);
+    handler_result(data, caml_callback_exn(handler, Val_unit));
+
+    CAMLreturn0;
+}
+
+static value
+set_start_cdata_handler(value parser,
+			XML_StartCdataSectionHandler c_handler,
+			value ocaml_handler)
+{
+    CAMLparam2(parser, ocaml_handler);
+    XML_Parser xml_parser = XML_Parser_val(parser);
+    struct expat_parser_data *data = XML_GetUserData(xml_parser);
+
+    Store_field(data->handlers, EXPAT_START_CDATA_HANDLER, ocaml_handler);
+    data->c.start_cdata_handler = c_handler;
+    if(data->skip_depth == 0)
+	XML_SetStartCdataSectionHandler(xml_parser, c_handler);
+
+    CAMLreturn (Val_unit);
+}
+
+/*
+ * external set_start_cdata_handler : expat_parser -> (unit -> unit) -> unit =
+ *   "expat_XML_SetStartCDataHandler"
+ */
+CAMLprim value
+expat_XML_SetStartCDataHandler(value parser, value handler)
+{
+    CAMLparam2(parser, handler);
+    CAMLreturn (set_start_cdata_handler(parser, start_cdata_handler, handler));
+}
+
+/*
+ * external reset_start_cdata_handler : expat_parser -> unit =
+ *   "expat_XML_ResetStartCDataHandler"
+ */
+CAMLprim value
+expat_XML_ResetStartCDataHandler(value parser)
+{
+    CAMLparam1(parser);
+    CAMLreturn (set_start_cdata_handler(parser, NULL, Val_unit));
+}
+
+/*
+ * End CData handler, setting and resetting
+ */
+static void
+end_cdata_handler(void *user_data)
+{
+    CAMLparam0();
+    struct expat_parser_data *data = user_data;
+    value handler;
+
+    if(handlers_stopped(data))
+	CAMLreturn0;
+
+    flush_text(data);
+
+    handler = Handler(data, EXPAT_END_CDATA_HANDLER);
+    handler_result(data, caml_callback_exn(handler, Val_unit));
+
+    CAMLreturn0;
+}
+
+static value
+set_end_cdata_handler(value parser,
+		      XML_EndCdataSectionHandler c_handler,
+		      value ocaml_handler)
+{
+    CAMLparam2(parser, ocaml_handler);
+    XML_Parser xml_parser = XML_Parser_val(parser);
+    struct expat_parser_data *data = XML_GetUserData(xml_parser);
+
+    Store_field(data->handlers, EXPAT_END_CDATA_HANDLER, ocaml_handler);
+    data->c.end_cdata_handler = c_handler;
+    if(data->skip_depth == 0)
+	XML_SetEndCdataSectionHandler(xml_parser, c_handler);
+
+    CAMLreturn (Val_unit);
+}
+
+/*
+ * external set_end_cdata_handler : expat_parser -> (unit -> unit) -> unit =
+ *   "expat_XML_SetEndCDataHandler"
+ */
+CAMLprim value
+expat_XML_SetEndCDataHandler(value parser, value handler)
+{
+    CAMLparam2(parser, handler);
+    CAMLreturn (set_end_cdata_handler(parser, end_cdata_handler, handler));
+}
+
+/*
+ * external reset_end_cdata_handler : expat_parser -> unit =
+ *   "expat_XML_ResetEndCDataHandler"
+ */
+CAMLprim value
+expat_XML_ResetEndCDataHandler(value parser)
+{
+    CAMLparam1(parser);
+    CAMLreturn (set_end_cdata_handler(parser, NULL, Val_unit));
+}
+
+
+/*
+ * Default handler, setting and resetting
+ */
+static void
+default_handler(void *user_data, const char *s, int len)
+{
+    CAMLparam0();
+    CAMLlocal1(d);
+    struct expat_parser_data *data = user_data;
+    value handler;
+
+    if(handlers_stopped(data))
+	CAMLreturn0;
+
+    flush_text(data);
+
+    d = caml_alloc_string(len);
+    memmove(String_val(d), s, len);
+    handler = Handler(data, EXPAT_DEFAULT_HANDLER);
+    handler_result(data, caml_callback_exn(handler, d));
+
+    CAMLreturn0;
+}
+
+static value
+set_default_handler(value parser,
+		    XML_DefaultHandler c_handler,
+		    value ocaml_handler)
+{
+    CAMLparam2(parser, ocaml_handler);
+    XML_Parser xml_parser = XML_Parser_val(parser);
+    struct expat_parser_data *data = XML_GetUserData(xml_parser);
+
+    Store_field(data->handlers, EXPAT_DEFAULT_HANDLER, ocaml_handler);
+    data->c.default_handler = c_handler;
+    if(data->skip_depth == 0)
+	XML_SetDefaultHandler(xml_parser, c_handler);
+
+    CAMLreturn (Val_unit);
+}
+
+/*
+ * external set_default_handler : expat_parser -> (string -> unit) -> unit =
+ *   "expat_XML_SetDefaultHandler"
+ */
+CAMLprim value
+expat_XML_SetDefaultHandler(value parser, value handler)
+{
+    CAMLparam2(parser, handler);
+    CAMLreturn (set_default_handler(parser, default_handler, handler));
+}
+
+static void
+default_handler_sub(void *user_data, const char *s, int len)
+{
+    struct expat_parser_data *data = user_data;
+
+    flush_text(data);
+    call_sub_handler(data, EXPAT_DEFAULT_HANDLER, s, len);
+}
+
+/*
+ * external set_default_handler_sub : expat_parser ->
+ *   (bytes -> int -> int -> unit) -> unit = "expat_SetDefaultHandlerSub"
+ */
+CAMLprim value
+expat_SetDefaultHandlerSub(value parser, value handler)
+{
+    CAMLparam2(parser, handler);
+    CAMLlocal1(pair);
+
+    pair = alloc_sub_handler(handler);
+    CAMLreturn (set_default_handler(parser, default_handler_sub, pair));
+}
+
+/*
+ * external reset_default_handler : expat_parser -> unit =
+ *   "expat_XML_ResetDefaultHandler"
+ */
+CAMLprim value
+expat_XML_ResetDefaultHandler(value parser)
+{
+    CAMLparam1(parser);
+    CAMLreturn (set_default_handler(parser, NULL, Val_unit));
+}
+
+/*
+ * Source spans. Instead of a copy of the text of an event, the span
+ * handlers are given the (start, end) byte offsets of the event in the
+ * document, and whether the span holds the text verbatim. No OCaml
+ * value is allocated.
+ */
+static void
+call_span_handler(struct expat_parser_data *data, int handler,
+		  XML_Index start, XML_Index end, int verbatim)
+{
+    if(handlers_stopped(data))
+	return;
+
+    handler_result(data, caml_callback3_exn(Handler(data, handler),
+					    Val_long(start), Val_long(end),
+					    Val_bool(verbatim)));
+}
+
+static void
+call_current_span_handler(struct expat_parser_data *data, int handler)
+{
+    XML_Index start = XML_GetCurrentByteIndex(data->parser);
+    int count = XML_GetCurrentByteCount(data->parser);
+
+    flush_text(data);
+    call_span_handler(data, handler, start, start + count, count > 0);
+}
+
+static void
+span_start_element_handler(void *user_data, const char *name,
+			   const char **attr)
+{
+    call_current_span_handler(user_data, EXPAT_START_ELEMENT_HANDLER);
+}
+
+static void
+span_end_element_handler(void *user_data, const char *name)
+{
+    call_current_span_handler(user_data, EXPAT_END_ELEMENT_HANDLER);
+}
+
+static void
+span_character_data_handler(void *user_data, const char *s, int len)
+{
+    struct expat_parser_data *data = user_data;
+    XML_Index start;
+
+    /* Text which was held back has its span tracked */
+    if(s == data->text.data) {
+	call_span_handler(data, EXPAT_CHARACTER_DATA_HANDLER, data->text_start,
+			  data->text_end, data->text_verbatim);
+	return;
     }
 
-    caml_raise_with_arg(*expat_error_exn, Val_long(error_code));
+    start = XML_GetCurrentByteIndex(data->parser);
+    call_span_handler(data, EXPAT_CHARACTER_DATA_HANDLER, start,
+		      start + XML_GetCurrentByteCount(data->parser),
+		      span_is_verbatim(data, s, len));
+}
+
+static void
+span_default_handler(void *user_data, const char *s, int len)
+{
+    struct expat_parser_data *data = user_data;
+    XML_Index start = XML_GetCurrentByteIndex(data->parser);
+
+    flush_text(data);
+    call_span_handler(data, EXPAT_DEFAULT_HANDLER, start,
+		      start + XML_GetCurrentByteCount(data->parser),
+		      span_is_verbatim(data, s, len));
+}
+
+/*
+ * external set_start_element_handler_span : expat_parser ->
+ *   (int -> int -> bool -> unit) -> unit = "expat_SetStartElementHandlerSpan"
+ */
+CAMLprim value
+expat_SetStartElementHandlerSpan(value parser, value handler)
+{
+    CAMLparam2(parser, handler);
+    CAMLreturn (set_start_handler(parser, span_start_element_handler,
+				  handler));
+}
+
+/*
+ * external set_end_element_handler_span : expat_parser ->
+ *   (int -> int -> bool -> unit) -> unit = "expat_SetEndElementHandlerSpan"
+ */
+CAMLprim value
+expat_SetEndElementHandlerSpan(value parser, value handler)
+{
+    CAMLparam2(parser, handler);
+    CAMLreturn (set_end_handler(parser, span_end_element_handler, handler));
+}
+
+/*
+ * external set_character_data_handler_span : expat_parser ->
+ *   (int -> int -> bool -> unit) -> unit =
+ *     "expat_SetCharacterDataHandlerSpan"
+ */
+CAMLprim value
+expat_SetCharacterDataHandlerSpan(value parser, value handler)
+{
+    CAMLparam2(parser, handler);
+    CAMLreturn (set_character_data_handler(parser,
+					   span_character_data_handler,
+					   handler));
+}
+
+/*
+ * external set_default_handler_span : expat_parser ->
+ *   (int -> int -> bool -> unit) -> unit = "expat_SetDefaultHandlerSpan"
+ */
+CAMLprim value
+expat_SetDefaultHandlerSpan(value parser, value handler)
+{
+    CAMLparam2(parser, handler);
+    CAMLreturn (set_default_handler(parser, span_default_handler, handler));
+}
+
+
+
+/*
+ * External Entity Ref handler, setting and resetting
+ */
+static int
+external_entity_ref_handler(XML_Parser xml_parser,
+			    const char *context, const char *base,
+			    const char *systemId, const char *publicId)
+{
+    CAMLparam0();
+    CAMLlocal4(caml_context, caml_base, caml_systemId, caml_publicId);
+    struct expat_parser_data *data = XML_GetUserData(xml_parser);
+    value handler;
+    value arg[4];
+
+    if(handlers_stopped(data))
+	CAMLreturn (XML_STATUS_OK);
+
+    flush_text(data);
+
+    /*
+     * Now put the strings into ocaml values. The parameters context,
+     * base, and publicId are optional systemId is never optional.
+     */
+    caml_context = Val_option_string(context);
+    caml_base = Val_option_string(base);
+    caml_systemId = caml_copy_string(systemId);
+    caml_publicId = Val_option_string(publicId);
+
+    /* Call the callback which has more than 3 parameters */
+    arg[0] = caml_context;
+    arg[1] = caml_base;
+    arg[2] = caml_systemId;
+    arg[3] = caml_publicId;
+    handler = Handler(data, EXPAT_EXTERNAL_ENTITY_REF_HANDLER);
+    handler_result(data, caml_callbackN_exn(handler, 4, arg));
+
+    CAMLreturn (XML_STATUS_OK);
+}
+
+static value
+set_external_entity_ref_handler(value parser,
+				XML_ExternalEntityRefHandler c_handler,
+				value ocaml_handler)
+{
+    CAMLparam2(parser, ocaml_handler);
+    XML_Parser xml_parser = XML_Parser_val(parser);
+    struct expat_parser_data *data = XML_GetUserData(xml_parser);
+
+    Store_field(data->handlers, EXPAT_EXTERNAL_ENTITY_REF_HANDLER, ocaml_handler);
+    data->c.external_entity_ref_handler = c_handler;
+    if(data->skip_depth == 0)
+	XML_SetExternalEntityRefHandler(xml_parser, c_handler);
+
+    CAMLreturn (Val_unit);
+}
+
+/*
+ * external set_external_entity_ref_handler : expat_parser ->
+ *   (string option -> string option -> string -> string option -> unit) ->
+ *     unit = "expat_XML_SetExternalEntityRefHandler"
+ */
+CAMLprim value
+expat_XML_SetExternalEntityRefHandler(value parser, value handler)
+{
+    CAMLparam2(parser, handler);
+    CAMLreturn (set_external_entity_ref_handler(parser,
+						external_entity_ref_handler,
+						handler));
+}
+
+/*
+ * external reset_external_entity_ref_handler : expat_parser -> unit =
+ *   "expat_XML_ResetDefaultHandler"
+ */
+CAMLprim value
+expat_XML_ResetExternalEntityRefHandler(value parser)
+{
+    CAMLparam1(parser);
+    CAMLreturn (set_external_entity_ref_handler(parser, NULL, Val_unit));
 }
 
 /*
- * external parse : expat_parser -> string -> unit =  "expat_XML_Parse"
+ * Namespace declaration handlers, setting and resetting
  */
-CAMLprim value
-expat_XML_Parse(value parser, value string)
+static void
+start_namespace_decl_handler(void *user_data, const char *prefix,
+			     const char *uri)
 {
-    CAMLparam2(parser, string);
-    XML_Parser xml_parser =  XML_Parser_val(parser);
+    CAMLparam0();
+    CAMLlocal2(caml_prefix, caml_uri);
+    struct expat_parser_data *data = user_data;
+    value handler;
 
-    if(!XML_Parse(xml_parser, String_val(string), caml_string_length(string), 0)) {
-	expat_error(XML_GetErrorCode(xml_parser));
-    }
+    if(handlers_stopped(data))
+	CAMLreturn0;
 
-    CAMLreturn (Val_unit);
+    flush_text(data);
+
+    caml_prefix = Val_option_string(prefix);
+    caml_uri = Val_option_string(uri);
+    handler = Handler(data, EXPAT_START_NAMESPACE_DECL_HANDLER);
+    handler_result(data, caml_callback2_exn(handler, caml_prefix, caml_uri));
+
+    CAMLreturn0;
 }
 
-/*
- * external parse_sub : expat_parser -> string -> int -> int -> unit =
- *   "expat_XML_ParseSub"
- */
-CAMLprim value
-expat_XML_ParseSub(value vparser, value vstring, value voffset, value vlen)
+static value
+set_start_namespace_decl_handler(value parser,
+				 XML_StartNamespaceDeclHandler c_handler,
+				 value ocaml_handler)
 {
-    CAMLparam2(vparser, vstring);
-    XML_Parser parser =  XML_Parser_val(vparser);
-    int len = Int_val(vlen);
-    int offset = Int_val(voffset);
-    int string_len = caml_string_length(vstring);
-    char *string = String_val(vstring);
-
-    /* sanity check on the parameters */
-    if((offset < 0) || (len < 0) || (offset > (string_len - len))) {
-	caml_invalid_argument("Expat.parse_sub");
-    }
+    CAMLparam2(parser, ocaml_handler);
+    XML_Parser xml_parser = XML_Parser_val(parser);
+    struct expat_parser_data *data = XML_GetUserData(xml_parser);
 
-    if(!XML_Parse(parser, string + offset, len, 0)) {
-	expat_error(XML_GetErrorCode(parser));
-    }
+    Store_field(data->handlers, EXPAT_START_NAMESPACE_DECL_HANDLER,
+		ocaml_handler);
+    data->c.start_namespace_decl_handler = c_handler;
+    if(data->skip_depth == 0)
+	XML_SetStartNamespaceDeclHandler(xml_parser, c_handler);
 
     CAMLreturn (Val_unit);
 }
 
 /*
- * external final : expat_parser -> unit = "expat_XML_Final"
+ * external set_start_namespace_decl_handler : expat_parser ->
+ *   (string option -> string option -> unit) -> unit =
+ *     "expat_XML_SetStartNamespaceDeclHandler"
  */
 CAMLprim value
-expat_XML_Final(value parser)
+expat_XML_SetStartNamespaceDeclHandler(value parser, value handler)
 {
-    CAMLparam1(parser);
-    XML_Parser xml_parser =  XML_Parser_val(parser);
-
-    if(!XML_Parse(xml_parser, NULL, 0, 1)) {
-	expat_error(XML_GetErrorCode(xml_parser));
-    }
-
-    CAMLreturn (Val_unit);
+    CAMLparam2(parser, handler);
+    CAMLreturn (set_start_namespace_decl_handler(parser,
+						 start_namespace_decl_handler,
+						 handler));
 }
 
 /*
- * Start element handling, setting and resetting.
+ * external reset_start_namespace_decl_handler : expat_parser -> unit =
+ *   "expat_XML_ResetStartNamespaceDeclHandler"
  */
+CAMLprim value
+expat_XML_ResetStartNamespaceDeclHandler(value parser)
+{
+    CAMLparam1(parser);
+    CAMLreturn (set_start_namespace_decl_handler(parser, NULL, Val_unit));
+}
+
 static void
-start_element_handler(void *user_data, const char *name, const char **attr)
+end_namespace_decl_handler(void *user_data, const char *prefix)
 {
     CAMLparam0();
-    CAMLlocal5(list, cons, prev, att, tag);
-    value *handlers = user_data;
-    int i;
+    CAMLlocal1(caml_prefix);
+    struct expat_parser_data *data = user_data;
+    value handler;
 
-    list = Val_unit;
-    prev = Val_unit;
+    if(handlers_stopped(data))
+	CAMLreturn0;
 
-    /* Create an assoc list with the attributes */
-    for(i = 0; attr[i]; i += 2) {
-	/* Create a tuple */
-	att = caml_alloc_tuple(2);
-	Store_field(att, 0, caml_copy_string(attr[i]));
-	Store_field(att, 1, caml_copy_string(attr[i + 1]));
+    flush_text(data);
 
-	/* Create a cons */
-	cons = caml_alloc_tuple(2);
-	Store_field(cons, 0, att);
-	Store_field(cons, 1, Val_unit);
-	if(prev != Val_unit) {
-	    Store_field(prev, 1, cons);
-	}
-	prev = cons;
-	if(list == Val_unit) {
-	    list = cons;
-	}
-    }
-    tag = caml_copy_string(name);
-    caml_callback2(Field(*handlers, EXPAT_START_ELEMENT_HANDLER), tag, list);
+    caml_prefix = Val_option_string(prefix);
+    handler = Handler(data, EXPAT_END_NAMESPACE_DECL_HANDLER);
+    handler_result(data, caml_callback_exn(handler, caml_prefix));
 
     CAMLreturn0;
 }
 
-static value set_start_handler(value parser,
-			       XML_StartElementHandler c_handler,
+static value
+set_end_namespace_decl_handler(value parser,
+			       XML_EndNamespaceDeclHandler c_handler,
 			       value ocaml_handler)
 {
     CAMLparam2(parser, ocaml_handler);
     XML_Parser xml_parser = XML_Parser_val(parser);
-    value *handlers = XML_GetUserData(xml_parser);
+    struct expat_parser_data *data = XML_GetUserData(xml_parser);
 
-    Store_field(*handlers, EXPAT_START_ELEMENT_HANDLER, ocaml_handler);
-    XML_SetStartElementHandler(xml_parser, c_handler);
+    Store_field(data->handlers, EXPAT_END_NAMESPACE_DECL_HANDLER,
+		ocaml_handler);
+    data->c.end_namespace_decl_handler = c_handler;
+    if(data->skip_depth == 0)
+	XML_SetEndNamespaceDeclHandler(xml_parser, c_handler);
 
     CAMLreturn (Val_unit);
 }
 
 /*
- * external set_start_element_handler : expat_parser ->
- *  (string -> (string * string) list -> unit) -> unit =
- *   "expat_XML_SetStartElementHandler"
+ * external set_end_namespace_decl_handler : expat_parser ->
+ *   (string option -> unit) -> unit = "expat_XML_SetEndNamespaceDeclHandler"
  */
 CAMLprim value
-expat_XML_SetStartElementHandler(value parser, value handler)
+expat_XML_SetEndNamespaceDeclHandler(value parser, value handler)
 {
     CAMLparam2(parser, handler);
-    CAMLreturn (set_start_handler(parser, start_element_handler, handler));
+    CAMLreturn (set_end_namespace_decl_handler(parser,
+					       end_namespace_decl_handler,
+					       handler));
 }
 
 /*
- * external reset_start_element_handler : expat_parser -> unit =
- *   "expat_XML_ResetStartElementHandler"
+ * external reset_end_namespace_decl_handler : expat_parser -> unit =
+ *   "expat_XML_ResetEndNamespaceDeclHandler"
  */
 CAMLprim value
-expat_XML_ResetStartElementHandler(value parser)
+expat_XML_ResetEndNamespaceDeclHandler(value parser)
 {
     CAMLparam1(parser);
-    CAMLreturn (set_start_handler(parser, NULL, Val_unit));
+    CAMLreturn (set_end_namespace_decl_handler(parser, NULL, Val_unit));
+}
+
+
+/*
+ * Batched event mode, setting and resetting.
+ *
+ * Instead of calling an OCaml handler for every start element, end
+ * element and character data event, the events are recorded in C
+ * and handed to the batch handler after each parsed chunk. Each record
+ * is a sequence of 32 bit words, strings are stored in a separate
+ * buffer and referenced by an (offset, length) pair of words:
+ *
+ *   EXPAT_EVENT_START_ELEMENT name nattrs (attr_name attr_value)*
+ *   EXPAT_EVENT_END_ELEMENT name
+ *   EXPAT_EVENT_CHARACTER_DATA data
+ *
+ * These numbers have to match the ones in expat.ml.
+ */
+enum expat_event {
+    EXPAT_EVENT_START_ELEMENT,
+    EXPAT_EVENT_END_ELEMENT,
+    EXPAT_EVENT_CHARACTER_DATA
+};
+
+static int
+record_word(struct expat_parser_data *data, int32_t word)
+{
+    return buffer_append(&data->events, &word, sizeof word);
+}
+
+static int
+record_string(struct expat_parser_data *data, const char *str, size_t len)
+{
+    return record_word(data, (int32_t) data->strings.len)
+	&& record_word(data, (int32_t) len)
+	&& buffer_append(&data->strings, str, len);
 }
 
 static void
-end_element_handler(void *user_data, const char *name)
+record_start_element(void *user_data, const char *name, const char **attr)
 {
-    value tag;
-    value *handlers = user_data;
+    struct expat_parser_data *data = user_data;
+    int i, ok, nattrs = 0;
 
-    tag = caml_copy_string(name);
-    caml_callback(Field(*handlers, EXPAT_END_ELEMENT_HANDLER), tag);
+    while(attr[2 * nattrs])
+	nattrs++;
+
+    ok = record_word(data, EXPAT_EVENT_START_ELEMENT)
+	&& record_string(data, name, strlen(name))
+	&& record_word(data, nattrs);
+    for(i = 0; ok && attr[i]; i++) {
+	ok = record_string(data, attr[i], strlen(attr[i]));
+    }
+    if(!ok)
+	record_failed(data);
+    count_event(data);
 }
 
-static value
-set_end_handler(value parser, XML_EndElementHandler c_handler,
-		value ocaml_handler)
+static void
+record_end_element(void *user_data, const char *name)
 {
-    CAMLparam2(parser, ocaml_handler);
-    XML_Parser xml_parser = XML_Parser_val(parser);
-    value *handlers = XML_GetUserData(xml_parser);
+    struct expat_parser_data *data = user_data;
 
-    Store_field(*handlers, EXPAT_END_ELEMENT_HANDLER, ocaml_handler);
-    XML_SetEndElementHandler(xml_parser, c_handler);
+    if(!(record_word(data, EXPAT_EVENT_END_ELEMENT)
+	 && record_string(data, name, strlen(name))))
+	record_failed(data);
+    count_event(data);
+}
 
-    CAMLreturn (Val_unit);
+static void
+record_character_data(void *user_data, const char *str, int len)
+{
+    struct expat_parser_data *data = user_data;
+
+    if(!(record_word(data, EXPAT_EVENT_CHARACTER_DATA)
+	 && record_string(data, str, len)))
+	record_failed(data);
+    count_event(data);
 }
 
 /*
- * external set_end_element_handler : expat_parser -> (string -> unit) -> unit =
- *   "expat_XML_SetEndElementHandler"
+ * Record the start element, end element and character data events,
+ * instead of calling their handlers.
+ */
+static void
+set_record_handlers(struct expat_parser_data *data)
+{
+    Store_field(data->handlers, EXPAT_START_ELEMENT_HANDLER, Val_unit);
+    Store_field(data->handlers, EXPAT_END_ELEMENT_HANDLER, Val_unit);
+    Store_field(data->handlers, EXPAT_CHARACTER_DATA_HANDLER, Val_unit);
+    data->c.start_element_handler = record_start_element;
+    data->c.end_element_handler = record_end_element;
+    data->c.character_data_handler = record_character_data;
+    install_element_handlers(data);
+}
+
+/*
+ * external set_event_batch_handler : expat_parser -> (events -> unit) ->
+ *   unit = "expat_SetEventBatchHandler"
+ *
+ * The batched events replace the start element, end element and
+ * character data handlers.
  */
 CAMLprim value
-expat_XML_SetEndElementHandler(value parser, value handler)
+expat_SetEventBatchHandler(value parser, value handler)
 {
     CAMLparam2(parser, handler);
-    CAMLreturn (set_end_handler(parser, end_element_handler, handler));
+    struct expat_parser_data *data = Parser_data_val(parser);
+
+    Store_field(data->handlers, EXPAT_EVENT_BATCH_HANDLER, handler);
+    data->pull = 0;
+    data->suspend_after = 0;
+    set_record_handlers(data);
+
+    CAMLreturn (Val_unit);
 }
 
 /*
- * external reset_end_element_handler : expat_parser -> unit =
- *   "expat_XML_ResetEndElementHandler"
+ * external reset_event_batch_handler : expat_parser -> unit =
+ *   "expat_ResetEventBatchHandler"
+ *
+ * Only the recording handlers are removed, handlers which were set
+ * after the batch handler stay in place.
  */
 CAMLprim value
-expat_XML_ResetEndElementHandler(value parser)
+expat_ResetEventBatchHandler(value parser)
 {
     CAMLparam1(parser);
-    CAMLreturn (set_end_handler(parser, NULL, Val_unit));
+    XML_Parser xml_parser = XML_Parser_val(parser);
+    struct expat_parser_data *data = XML_GetUserData(xml_parser);
+
+    Store_field(data->handlers, EXPAT_EVENT_BATCH_HANDLER, Val_unit);
+    data->pull = 0;
+    data->suspend_after = 0;
+    if(Handler(data, EXPAT_START_ELEMENT_HANDLER) == Val_unit) {
+	data->c.start_element_handler = NULL;
+    }
+    if(Handler(data, EXPAT_END_ELEMENT_HANDLER) == Val_unit) {
+	data->c.end_element_handler = NULL;
+    }
+    if(Handler(data, EXPAT_CHARACTER_DATA_HANDLER) == Val_unit) {
+	data->c.character_data_handler = NULL;
+    }
+    install_element_handlers(data);
+    data->events.len = 0;
+    data->strings.len = 0;
+
+    CAMLreturn (Val_unit);
 }
 
 /*
- * Character data handling, setting, and resetting
+ * Pull mode, used by the Pull module of expat.ml.
+ *
+ * The events are recorded as in batched event mode, but expat is
+ * suspended with XML_StopParser every few events, so that the cursor
+ * takes them with expat_PullTake and resumes expat only once they have
+ * all been consumed. Parsing a chunk or resuming returns true when
+ * expat was suspended, and false once the chunk has been parsed.
  */
-static void
-character_data_handler(void *user_data, const char *data, int len)
+
+/*
+ * external set_pull_mode : expat_parser -> int -> unit =
+ *   "expat_SetPullMode"
+ */
+CAMLprim value
+expat_SetPullMode(value parser, value events)
 {
-    CAMLparam0();
-    CAMLlocal1(str);
-    value *handlers = user_data;
+    CAMLparam2(parser, events);
+    struct expat_parser_data *data = Parser_data_val(parser);
 
-    str = caml_alloc_string(len);
-    memcpy(String_val(str), data, len);
-    caml_callback(Field(*handlers, EXPAT_CHARACTER_DATA_HANDLER), str);
+    if(Int_val(events) <= 0)
+	caml_invalid_argument("Expat.Pull");
 
-    CAMLreturn0;
+    Store_field(data->handlers, EXPAT_EVENT_BATCH_HANDLER, Val_unit);
+    data->pull = 1;
+    data->suspend_after = Int_val(events);
+    data->delivered = 0;
+    set_record_handlers(data);
+
+    CAMLreturn (Val_unit);
 }
 
-static value set_character_data_handler(value parser,
-					XML_CharacterDataHandler c_handler,
-					value ocaml_handler)
+static value
+pull_parse(value parser, const char *s, int len, value is_final, int in_heap)
 {
-    CAMLparam2(parser, ocaml_handler);
     XML_Parser xml_parser = XML_Parser_val(parser);
-    value *handlers = XML_GetUserData(xml_parser);
+    int status;
 
-    Store_field(*handlers, EXPAT_CHARACTER_DATA_HANDLER, ocaml_handler);
-    XML_SetCharacterDataHandler(xml_parser, c_handler);
+    if(Parser_data_val(parser)->stopped)
+	return Val_false;
 
-    CAMLreturn (Val_unit);
+    status = xml_parse(xml_parser, s, len, Bool_val(is_final), !in_heap);
+    parse_done(xml_parser, status);
+    return Val_bool(status == XML_STATUS_SUSPENDED);
 }
 
+/*
+ * external pull_parse : expat_parser -> string -> int -> int -> bool ->
+ *   bool = "expat_PullParse"
+ *
+ * Expat copies what is left of the chunk to its own buffer when it is
+ * suspended, so the string may move before the parser is resumed.
+ */
+CAMLprim value
+expat_PullParse(value vparser, value vstring, value voffset, value vlen,
+		value is_final)
+{
+    CAMLparam2(vparser, vstring);
+    int len = Int_val(vlen);
+    int offset = Int_val(voffset);
+
+    if((offset < 0) || (len < 0)
+       || (offset > ((int) caml_string_length(vstring) - len))) {
+	caml_invalid_argument("Expat.Pull");
+    }
+
+    CAMLreturn (pull_parse(vparser, String_val(vstring) + offset, len,
+			   is_final, 1));
+}
 
 /*
- * external set_character_data_handler : expat_parser -> (string -> unit) -> unit =
- *   "expat_XML_SetCharacterDataHandler"
+ * external pull_parse_bigarray : expat_parser -> bigarray -> int -> int ->
+ *   bool -> bool = "expat_PullParseBigarray"
  */
 CAMLprim value
-expat_XML_SetCharacterDataHandler(value parser, value handler)
+expat_PullParseBigarray(value vparser, value vbuf, value voffset, value vlen,
+			value is_final)
 {
-    CAMLparam2(parser, handler);
-    CAMLreturn (set_character_data_handler(parser, character_data_handler,
-					   handler));
+    CAMLparam2(vparser, vbuf);
+    intnat len = Long_val(vlen);
+    intnat offset = Long_val(voffset);
+
+    if((offset < 0) || (len < 0) || (len > EXPAT_MAX_CHUNK)
+       || (offset > Caml_ba_array_val(vbuf)->dim[0] - len)) {
+	caml_invalid_argument("Expat.Pull");
+    }
+
+    CAMLreturn (pull_parse(vparser, (char *) Caml_ba_data_val(vbuf) + offset,
+			   len, is_final, 0));
 }
 
 /*
- * external reset_end_element_handler : expat_parser -> unit =
- *   "expat_XML_ResetEndElementHandler"
+ * external pull_resume : expat_parser -> bool = "expat_PullResume"
  */
 CAMLprim value
-expat_XML_ResetCharacterDataHandler(value parser)
+expat_PullResume(value parser)
 {
     CAMLparam1(parser);
-    CAMLreturn (set_character_data_handler(parser, NULL, Val_unit));
+    XML_Parser xml_parser = XML_Parser_val(parser);
+    int status;
+
+    if(Parser_data_val(parser)->stopped)
+	CAMLreturn (Val_false);
+
+    status = xml_resume(xml_parser);
+    parse_done(xml_parser, status);
+    CAMLreturn (Val_bool(status == XML_STATUS_SUSPENDED));
 }
 
 /*
- * Process instruction, setting and resetting
+ * external pull_take : expat_parser -> events = "expat_PullTake"
+ */
+CAMLprim value
+expat_PullTake(value parser)
+{
+    CAMLparam1(parser);
+    CAMLreturn (take_events(Parser_data_val(parser)));
+}
+
+/*
+ * Tree building, used by the Tree module of expat.ml.
+ *
+ * The document is parsed by a parser of its own, whose handlers build
+ * the tree in C buffers, which are then handed over to bigarrays. A
+ * node is EXPAT_TREE_NODE_WORDS 32 bit words:
+ *
+ *   kind name first_child next_sibling offset length
+ *
+ * where kind is one of enum expat_tree_node, name the symbol of the
+ * name of an element, and first_child and next_sibling are node
+ * indexes, or -1. For an element, offset and length are the range of
+ * its attributes, for a text node its span in the strings. An
+ * attribute is the symbol of its name and the span of its value, and
+ * a symbol is the span of its name. The root element is node 0.
+ *
+ * These numbers have to match the ones in expat.ml.
  */
+#define EXPAT_TREE_NODE_WORDS 6
+#define EXPAT_TREE_ATTRIBUTE_WORDS 3
+
+enum expat_tree_node {
+    EXPAT_TREE_ELEMENT,
+    EXPAT_TREE_TEXT
+};
+
+struct expat_tree {
+    XML_Parser parser;
+    struct expat_buffer nodes;
+    struct expat_buffer attributes;
+    struct expat_buffer names;
+    struct expat_buffer strings;
+    struct expat_symbols *symbols;
+
+    /* The open elements, and the last child of each of them, or -1 */
+    struct expat_buffer stack;
+
+    /* The text node which the next character data extends, or -1 */
+    int32_t last_text;
+    int failed;
+};
+
 static void
-processing_instruction_handler(void *user_data,  const char *target,
-			       const char *data)
+tree_free(struct expat_tree *tree)
 {
-    CAMLparam0();
-    CAMLlocal2(t, d);
-    value *handlers = user_data;
+    buffer_free(&tree->nodes);
+    buffer_free(&tree->attributes);
+    buffer_free(&tree->names);
+    buffer_free(&tree->strings);
+    buffer_free(&tree->stack);
+    symbols_release(tree->symbols);
+}
 
-    t = caml_copy_string(target);
-    d = caml_copy_string(data);
-    caml_callback2(Field(*handlers, EXPAT_PROCESSING_INSTRUCTION_HANDLER), t, d);
+static void
+tree_failed(struct expat_tree *tree)
+{
+    if(!tree->failed) {
+	tree->failed = 1;
+	XML_StopParser(tree->parser, XML_FALSE);
+    }
+}
 
-    CAMLreturn0;
+static int32_t *
+tree_node(struct expat_tree *tree, int32_t node)
+{
+    return (int32_t *) tree->nodes.data + node * EXPAT_TREE_NODE_WORDS;
 }
 
-static value
-set_processing_instruction_handler(value parser,
-				   XML_ProcessingInstructionHandler c_handler,
-				   value ocaml_handler)
+/*
+ * Append a string, and return its offset, or -1. The strings are
+ * limited to 2 GB, so that offsets fit in the words of the nodes.
+ */
+static int32_t
+tree_string(struct expat_tree *tree, const char *s, size_t len)
 {
-    CAMLparam2(parser, ocaml_handler);
-    XML_Parser xml_parser = XML_Parser_val(parser);
-    value *handlers = XML_GetUserData(xml_parser);
+    size_t offset = tree->strings.len;
 
-    Store_field(*handlers,
-		EXPAT_PROCESSING_INSTRUCTION_HANDLER, ocaml_handler);
-    XML_SetProcessingInstructionHandler(xml_parser, c_handler);
+    if(len > INT32_MAX - offset || !buffer_append(&tree->strings, s, len))
+	return -1;
+    return (int32_t) offset;
+}
 
-    CAMLreturn (Val_unit);
+/* The symbol of a name, which is added to the names when it is new */
+static int32_t
+tree_symbol(struct expat_tree *tree, const char *name)
+{
+    size_t len = strlen(name);
+    size_t count = tree->symbols->count;
+    intnat symbol = symbols_intern(tree->symbols, name, len);
+    int32_t span[2];
+
+    if(symbol >= 0 && tree->symbols->count > count) {
+	span[0] = tree_string(tree, name, len);
+	span[1] = (int32_t) len;
+	if(span[0] < 0 || !buffer_append(&tree->names, span, sizeof span))
+	    return -1;
+    }
+    return (int32_t) symbol;
 }
 
 /*
- * external set_processing_instruction_handler : expat_parser ->
- *   (string -> string -> unit) -> unit =
- *      "expat_XML_SetProcessingInstructionHandler"
+ * Append a node, and make it the next child of the current element.
+ * Returns its index, or -1.
  */
-CAMLprim value
-expat_XML_SetProcessingInstructionHandler(value parser, value handler)
+static int32_t
+tree_add_node(struct expat_tree *tree, int32_t kind, int32_t name,
+	      int32_t offset, int32_t length)
 {
-    CAMLparam2(parser, handler);
-    CAMLreturn (set_processing_instruction_handler(parser,
-						   processing_instruction_handler,
-						   handler));
+    size_t index = tree->nodes.len / (EXPAT_TREE_NODE_WORDS * 4);
+    int32_t node[EXPAT_TREE_NODE_WORDS];
+    int32_t *open;
+
+    node[0] = kind;
+    node[1] = name;
+    node[2] = -1;
+    node[3] = -1;
+    node[4] = offset;
+    node[5] = length;
+    if(index > INT32_MAX || !buffer_append(&tree->nodes, node, sizeof node))
+	return -1;
+
+    if(tree->stack.len > 0) {
+	open = (int32_t *) (tree->stack.data + tree->stack.len) - 2;
+	if(open[1] < 0)
+	    tree_node(tree, open[0])[2] = (int32_t) index;
+	else
+	    tree_node(tree, open[1])[3] = (int32_t) index;
+	open[1] = (int32_t) index;
+    }
+    return (int32_t) index;
+}
+
+static void
+tree_start_element(void *user_data, const char *name, const char **attr)
+{
+    struct expat_tree *tree = user_data;
+    size_t first = tree->attributes.len / (EXPAT_TREE_ATTRIBUTE_WORDS * 4);
+    int32_t attribute[EXPAT_TREE_ATTRIBUTE_WORDS];
+    int32_t open[2];
+    size_t len;
+    int i, ok = 1;
+
+    for(i = 0; ok && attr[i]; i += 2) {
+	len = strlen(attr[i + 1]);
+	attribute[0] = tree_symbol(tree, attr[i]);
+	attribute[1] = tree_string(tree, attr[i + 1], len);
+	attribute[2] = (int32_t) len;
+	ok = attribute[0] >= 0 && attribute[1] >= 0
+	    && buffer_append(&tree->attributes, attribute, sizeof attribute);
+    }
+
+    open[1] = -1;
+    open[0] = ok ? tree_symbol(tree, name) : -1;
+    if(open[0] >= 0)
+	open[0] = tree_add_node(tree, EXPAT_TREE_ELEMENT, open[0],
+				(int32_t) first, i / 2);
+    if(open[0] < 0 || !buffer_append(&tree->stack, open, sizeof open))
+	tree_failed(tree);
+    tree->last_text = -1;
+}
+
+static void
+tree_end_element(void *user_data, const char *name)
+{
+    struct expat_tree *tree = user_data;
+
+    if(tree->stack.len > 0)
+	tree->stack.len -= 2 * sizeof(int32_t);
+    tree->last_text = -1;
+}
+
+static void
+tree_character_data(void *user_data, const char *s, int len)
+{
+    struct expat_tree *tree = user_data;
+    int32_t offset = tree_string(tree, s, len);
+
+    if(offset < 0) {
+	tree_failed(tree);
+    } else if(tree->last_text >= 0) {
+	/* Expat gives text in pieces, which follow each other */
+	tree_node(tree, tree->last_text)[5] += len;
+    } else {
+	tree->last_text = tree_add_node(tree, EXPAT_TREE_TEXT, -1, offset, len);
+	if(tree->last_text < 0)
+	    tree_failed(tree);
+    }
+}
+
+/*
+ * Hand a buffer over to a bigarray, which frees it when collected.
+ */
+static value
+tree_bigarray(struct expat_buffer *buf, int kind, size_t elt_size)
+{
+    intnat dim = buf->len / elt_size;
+    void *data = NULL;
+
+    /* With no data, caml_ba_alloc_dims allocates an empty array */
+    if(dim > 0) {
+	/* Give back the room the buffer has beyond its length */
+	data = realloc(buf->data, buf->len);
+	if(data == NULL)
+	    data = buf->data;
+	buf->data = NULL;
+	buf->len = buf->size = 0;
+    }
+    return caml_ba_alloc_dims(kind | CAML_BA_C_LAYOUT | CAML_BA_MANAGED,
+			      1, data, dim);
 }
 
 /*
- * external reset_processing_instruction_handler : expat_parser -> unit =
- *   "expat_XML_ResetProcessingInstructionHandler"
+ * external parse_tree : char option -> string -> tree = "expat_TreeParse"
+ *
+ * The string is copied to the buffer of the parser a block at a time,
+ * and expat runs without the runtime lock.
  */
 CAMLprim value
-expat_XML_ResetProcessingInstructionHandler(value parser)
+expat_TreeParse(value sep, value string)
 {
-    CAMLparam1(parser);
-    CAMLreturn (set_processing_instruction_handler(parser, NULL, Val_unit));
+    CAMLparam2(sep, string);
+    CAMLlocal5(result, nodes, attributes, names, strings);
+    struct expat_memory *memory = memory_create(1);
+    struct expat_tree tree;
+    XML_Char separator[2];
+    struct expat_memory *saved;
+    size_t len = caml_string_length(string), pos = 0;
+    int chunk, status = XML_STATUS_OK, error;
+    void *buf;
+
+    memset(&tree, 0, sizeof tree);
+    tree.last_text = -1;
+    tree.symbols = symbols_create();
+    separator[0] = Is_block(sep) ? (char) Long_val(Field(sep, 0)) : '\0';
+    separator[1] = '\0';
+    tree.parser = xml_parser_create(NULL, Is_block(sep) ? separator : NULL,
+				    memory);
+    if(tree.symbols == NULL || tree.parser == NULL) {
+	if(tree.parser != NULL)
+	    XML_ParserFree(tree.parser);
+	tree_free(&tree);
+	memory_release(memory);
+	caml_raise_out_of_memory();
+    }
+    XML_SetUserData(tree.parser, &tree);
+    XML_SetElementHandler(tree.parser, tree_start_element, tree_end_element);
+    XML_SetCharacterDataHandler(tree.parser, tree_character_data);
+
+    saved = expat_current_memory;
+    expat_current_memory = memory;
+    do {
+	chunk = len - pos > EXPAT_READ_SIZE ? EXPAT_READ_SIZE : len - pos;
+	buf = XML_GetBuffer(tree.parser, chunk);
+	if(buf == NULL) {
+	    status = XML_STATUS_ERROR;
+	    break;
+	}
+	memcpy(buf, String_val(string) + pos, chunk);
+	pos += chunk;
+	caml_release_runtime_system();
+	status = XML_ParseBuffer(tree.parser, chunk, pos == len);
+	caml_acquire_runtime_system();
+    } while(status == XML_STATUS_OK && pos < len);
+    error = XML_GetErrorCode(tree.parser);
+    XML_ParserFree(tree.parser);
+    memory_leave(saved);
+    memory_release(memory);
+
+    if(tree.failed || status != XML_STATUS_OK) {
+	tree_free(&tree);
+	if(tree.failed)
+	    caml_raise_out_of_memory();
+	expat_error(error);
+    }
+
+    nodes = tree_bigarray(&tree.nodes, CAML_BA_INT32, 4);
+    attributes = tree_bigarray(&tree.attributes, CAML_BA_INT32, 4);
+    names = tree_bigarray(&tree.names, CAML_BA_INT32, 4);
+    strings = tree_bigarray(&tree.strings, CAML_BA_CHAR, 1);
+    tree_free(&tree);
+
+    result = caml_alloc_tuple(4);
+    Store_field(result, 0, nodes);
+    Store_field(result, 1, attributes);
+    Store_field(result, 2, names);
+    Store_field(result, 3, strings);
+
+    CAMLreturn (result);
 }
 
 /*
- * Comment handler, setting and resetting
+ * external tree_string : bigarray -> int -> int -> string =
+ *   "expat_TreeString"
  */
-static void
-comment_handler(void *user_data, const char *data)
+CAMLprim value
+expat_TreeString(value strings, value offset, value len)
 {
-    CAMLparam0();
-    CAMLlocal1(d);
-
-    value *handlers = user_data;
-    d = caml_copy_string(data);
-    caml_callback(Field(*handlers, EXPAT_COMMENT_HANDLER), d);
+    CAMLparam1(strings);
+    CAMLlocal1(result);
 
-    CAMLreturn0;
+    result = caml_alloc_initialized_string(Long_val(len),
+					   (char *) Caml_ba_data_val(strings)
+					   + Long_val(offset));
+    CAMLreturn (result);
 }
 
-static value
-set_comment_handler(value parser,
-		    XML_CommentHandler c_handler, value ocaml_handler)
+/*
+ * The index of the first of the len bytes at s which cannot be written
+ * as they are in text, or in an attribute value when attr is set, or
+ * len. Clean strings are scanned 16 bytes at a time when SSE2 is
+ * available.
+ */
+static size_t
+escape_scan(const char *s, size_t len, int attr)
 {
-    CAMLparam2(parser, ocaml_handler);
-    XML_Parser xml_parser = XML_Parser_val(parser);
-    value *handlers = XML_GetUserData(xml_parser);
-
-    Store_field(*handlers, EXPAT_COMMENT_HANDLER, ocaml_handler);
-    XML_SetCommentHandler(xml_parser, c_handler);
+    size_t i = 0;
+
+#ifdef __SSE2__
+    const __m128i lt = _mm_set1_epi8('<');
+    const __m128i amp = _mm_set1_epi8('&');
+    const __m128i gt = _mm_set1_epi8('>');
+    const __m128i quot = _mm_set1_epi8(attr ? '"' : '<');
+    const __m128i ctrl = _mm_set1_epi8(0x1f);
+
+    for(; i + 16 <= len; i += 16) {
+	__m128i v = _mm_loadu_si128((const __m128i *) (s + i));
+	/* The control characters are the bytes which max leaves alone */
+	__m128i special =
+	    _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, lt),
+				      _mm_cmpeq_epi8(v, amp)),
+			 _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, gt),
+						   _mm_cmpeq_epi8(v, quot)),
+				      _mm_cmpeq_epi8(_mm_max_epu8(v, ctrl),
+						     ctrl)));
+	int mask = _mm_movemask_epi8(special);
+
+	if(mask != 0)
+	    return i + __builtin_ctz(mask);
+    }
+#endif
+    for(; i < len; i++) {
+	unsigned char c = s[i];
 
-    CAMLreturn (Val_unit);
+	if(c < 0x20 || c == '<' || c == '&' || c == '>' || (attr && c == '"'))
+	    return i;
+    }
+    return i;
 }
 
 /*
- * external set_comment_handler : expat_parser -> (string -> unit) -> unit =
- *   "expat_XML_SetCommentHandler"
+ * Append the len bytes at s to buf, escaped to be text, or the value of
+ * an attribute in double quotes when attr is set. In an attribute
+ * value, the whitespace characters other than space are written as
+ * references, which attribute value normalization keeps. Returns 0
+ * when out of memory, and -1 for a control character, which XML does
+ * not allow.
  */
-CAMLprim value
-expat_XML_SetCommentHandler(value parser, value handler)
+static int
+escape_append(struct expat_buffer *buf, const char *s, size_t len, int attr)
 {
-    CAMLparam2(parser, handler);
-    CAMLreturn (set_comment_handler(parser, comment_handler, handler));
+    size_t i = 0, j;
+    const char *ref;
+
+    for(;;) {
+	j = i + escape_scan(s + i, len - i, attr);
+	if(!buffer_append(buf, s + i, j - i))
+	    return 0;
+	if(j == len)
+	    return 1;
+	switch(s[j]) {
+	case '<': ref = "&lt;"; break;
+	case '&': ref = "&amp;"; break;
+	case '>': ref = "&gt;"; break;
+	case '"': ref = "&quot;"; break;
+	case '\r': ref = "&#13;"; break;
+	case '\t': ref = attr ? "&#9;" : "\t"; break;
+	case '\n': ref = attr ? "&#10;" : "\n"; break;
+	default: return -1;
+	}
+	if(!buffer_append(buf, ref, strlen(ref)))
+	    return 0;
+	i = j + 1;
+    }
 }
 
 /*
- * external reset_comment_handler : expat_parser -> unit =
- *   "expat_XML_ResetCommentHandler"
+ * Write the contents of buf to fd, and empty it, without the runtime
+ * lock. Returns -1 with errno set when writing fails, what was not
+ * written is then left in buf.
  */
-CAMLprim value
-expat_XML_ResetCommentHandler(value parser)
+static int
+buffer_write(struct expat_buffer *buf, int fd)
 {
-    CAMLparam1(parser);
-    CAMLreturn (set_comment_handler(parser, NULL, Val_unit));
+    size_t pos = 0;
+    ssize_t n;
+    int err;
+
+    while(pos < buf->len) {
+	caml_release_runtime_system();
+	n = write(fd, buf->data + pos, buf->len - pos);
+	err = errno;
+	caml_acquire_runtime_system();
+
+	if(n < 0) {
+	    if(err == EINTR) {
+		caml_process_pending_actions();
+		continue;
+	    }
+	    memmove(buf->data, buf->data + pos, buf->len - pos);
+	    buf->len -= pos;
+	    errno = err;
+	    return -1;
+	}
+	pos += n;
+    }
+    buf->len = 0;
+    return 0;
 }
 
 /*
- * Start CData handler, setting and resetting
+ * Rewriting, used by the Rewrite module of expat.ml.
+ *
+ * The document is parsed by a parser of its own, whose default handler
+ * copies every token to the output as it is in the input. Only the
+ * start tags of the elements with one of the given names are handed to
+ * OCaml, whose handler may give new attributes for them. Tokens which
+ * follow each other in the input of expat are copied at once: the
+ * default handler only extends the run of input which is to be copied,
+ * and the run is copied before anything else is written, and when
+ * expat returns, as the input may then move.
  */
+struct expat_rewrite {
+    XML_Parser parser;
+    struct expat_memory *memory;
+    struct expat_symbols *names;
+    value *handler;
+    value *exn;
+    struct expat_buffer out;
+
+    /* The input not copied to out yet */
+    const char *run;
+    size_t run_len;
+
+    /* Whether the last start tag written is not closed yet */
+    int tag_open;
+    int failed;
+    int invalid;	/* an attribute value has a control character */
+};
+
 static void
-start_cdata_handler(void *user_data)
+rewrite_free(struct expat_rewrite *rw)
 {
-    CAMLparam0();
-    value *handlers = user_data;
+    if(rw->parser != NULL)
+	XML_ParserFree(rw->parser);
+    rw->parser = NULL;
+    memory_release(rw->memory);
+    rw->memory = NULL;
+    symbols_release(rw->names);
+    rw->names = NULL;
+    buffer_free(&rw->out);
+}
 
-    caml_callback(Field(*handlers, EXPAT_START_CDATA_HANDLER), Val_unit);
+static void
+rewrite_append(struct expat_rewrite *rw, const char *s, size_t len)
+{
+    if(!buffer_append(&rw->out, s, len) && !rw->failed) {
+	rw->failed = 1;
+	XML_StopParser(rw->parser, XML_FALSE);
+    }
+}
 
-    CAMLreturn0;
+static void
+rewrite_flush_run(struct expat_rewrite *rw)
+{
+    if(rw->run_len > 0)
+	rewrite_append(rw, rw->run, rw->run_len);
+    rw->run_len = 0;
 }
 
-static value
-set_start_cdata_handler(value parser,
-			XML_StartCdataSectionHandler c_handler,
-			value ocaml_handler)
+static void rewrite_end_element(void *user_data, const char *name);
+
+/*
+ * Write the end of the last start tag written, which is left open
+ * until it is known whether the element is empty.
+ */
+static void
+rewrite_close_tag(struct expat_rewrite *rw, int empty)
 {
-    CAMLparam2(parser, ocaml_handler);
-    XML_Parser xml_parser = XML_Parser_val(parser);
-    value *handlers = XML_GetUserData(xml_parser);
+    if(rw->tag_open) {
+	rw->tag_open = 0;
+	XML_SetEndElementHandler(rw->parser, NULL);
+	rewrite_append(rw, empty ? "/>" : ">", empty ? 2 : 1);
+    }
+}
 
-    Store_field(*handlers, EXPAT_START_CDATA_HANDLER, ocaml_handler);
-    XML_SetStartCdataSectionHandler(xml_parser, c_handler);
+static void
+rewrite_default(void *user_data, const char *s, int len)
+{
+    struct expat_rewrite *rw = user_data;
+    int offset, size;
+    const char *context = XML_GetInputContext(rw->parser, &offset, &size);
+
+    rewrite_close_tag(rw, 0);
+    if(rw->run_len > 0 && rw->run + rw->run_len == s) {
+	rw->run_len += len;
+	return;
+    }
+    rewrite_flush_run(rw);
 
-    CAMLreturn (Val_unit);
+    /* Converted text is not in the input, and does not stay */
+    if(context != NULL && s >= context && s < context + size) {
+	rw->run = s;
+	rw->run_len = len;
+    } else {
+	rewrite_append(rw, s, len);
+    }
 }
 
 /*
- * external set_start_cdata_handler : expat_parser -> (unit -> unit) -> unit =
- *   "expat_XML_SetStartCDataHandler"
+ * The output is in UTF-8, so the XML declaration of a document in
+ * another encoding is written again without its encoding. Other
+ * declarations are copied.
  */
-CAMLprim value
-expat_XML_SetStartCDataHandler(value parser, value handler)
+static void
+rewrite_xml_decl(void *user_data, const char *version, const char *encoding,
+		 int standalone)
 {
-    CAMLparam2(parser, handler);
-    CAMLreturn (set_start_cdata_handler(parser, start_cdata_handler, handler));
+    struct expat_rewrite *rw = user_data;
+
+    if(encoding == NULL || strcasecmp(encoding, "UTF-8") == 0) {
+	XML_DefaultCurrent(rw->parser);
+	return;
+    }
+    rewrite_flush_run(rw);
+    rewrite_append(rw, "<?xml version=\"", 15);
+    version = version != NULL ? version : "1.0";
+    rewrite_append(rw, version, strlen(version));
+    rewrite_append(rw, "\"", 1);
+    if(standalone != -1)
+	rewrite_append(rw, standalone ? " standalone=\"yes\""
+		       : " standalone=\"no\"", standalone ? 17 : 16);
+    rewrite_append(rw, "?>", 2);
 }
 
 /*
- * external reset_start_cdata_handler : expat_parser -> unit =
- *   "expat_XML_ResetStartCDataHandler"
+ * Write the start tag of an element with the name and the attributes
+ * given by OCaml.
  */
-CAMLprim value
-expat_XML_ResetStartCDataHandler(value parser)
+static void
+rewrite_start_tag(struct expat_rewrite *rw, const char *name, value attrs)
 {
-    CAMLparam1(parser);
-    CAMLreturn (set_start_cdata_handler(parser, NULL, Val_unit));
+    value attr;
+    int status;
+
+    rewrite_flush_run(rw);
+    rewrite_append(rw, "<", 1);
+    rewrite_append(rw, name, strlen(name));
+    for(; attrs != Val_emptylist; attrs = Field(attrs, 1)) {
+	attr = Field(attrs, 0);
+	rewrite_append(rw, " ", 1);
+	rewrite_append(rw, String_val(Field(attr, 0)),
+		       caml_string_length(Field(attr, 0)));
+	rewrite_append(rw, "=\"", 2);
+	status = escape_append(&rw->out, String_val(Field(attr, 1)),
+			       caml_string_length(Field(attr, 1)), 1);
+	if(status <= 0 && !rw->failed) {
+	    rw->failed = 1;
+	    rw->invalid = status < 0;
+	    XML_StopParser(rw->parser, XML_FALSE);
+	}
+	rewrite_append(rw, "\"", 1);
+    }
+
+    /* Expat reports the end of an empty element right after its start */
+    rw->tag_open = 1;
+    XML_SetEndElementHandler(rw->parser, rewrite_end_element);
 }
 
-/*
- * End CData handler, setting and resetting
- */
 static void
-end_cdata_handler(void *user_data)
+rewrite_start_element(void *user_data, const char *name, const char **attr)
 {
     CAMLparam0();
-    value *handlers = user_data;
+    CAMLlocal3(tag, list, result);
+    struct expat_rewrite *rw = user_data;
 
-    caml_callback(Field(*handlers, EXPAT_END_CDATA_HANDLER), Val_unit);
+    rewrite_close_tag(rw, 0);
+    if(symbols_find(rw->names, name, strlen(name)) < 0) {
+	XML_DefaultCurrent(rw->parser);
+	CAMLreturn0;
+    }
 
+    tag = caml_copy_string(name);
+    list = attribute_list(attr);
+    result = caml_callback2_exn(*rw->handler, tag, list);
+    if(Is_exception_result(result)) {
+	*rw->exn = Extract_exception(result);
+	XML_StopParser(rw->parser, XML_FALSE);
+    } else if(Is_block(result)) {
+	rewrite_start_tag(rw, name, Field(result, 0));
+    } else {
+	XML_DefaultCurrent(rw->parser);
+    }
     CAMLreturn0;
 }
 
-static value
-set_end_cdata_handler(value parser,
-		      XML_EndCdataSectionHandler c_handler,
-		      value ocaml_handler)
+/*
+ * Only installed while a start tag is open: the end of an empty element
+ * has no text in the input.
+ */
+static void
+rewrite_end_element(void *user_data, const char *name)
 {
-    CAMLparam2(parser, ocaml_handler);
-    XML_Parser xml_parser = XML_Parser_val(parser);
-    value *handlers = XML_GetUserData(xml_parser);
+    struct expat_rewrite *rw = user_data;
 
-    Store_field(*handlers, EXPAT_END_CDATA_HANDLER, ocaml_handler);
-    XML_SetEndCdataSectionHandler(xml_parser, c_handler);
+    rewrite_close_tag(rw, XML_GetCurrentByteCount(rw->parser) == 0);
+    XML_DefaultCurrent(rw->parser);
+}
 
-    CAMLreturn (Val_unit);
+/*
+ * Write the output to fd, when it is not -1.
+ */
+static void
+rewrite_write(struct expat_rewrite *rw, int fd)
+{
+    int err;
+
+    if(fd >= 0 && buffer_write(&rw->out, fd) < 0) {
+	err = errno;
+	rewrite_free(rw);
+	errno = err;
+	uerror("write", Nothing);
+    }
 }
 
 /*
- * external set_end_cdata_handler : expat_parser -> (unit -> unit) -> unit =
- *   "expat_XML_SetEndCDataHandler"
+ * Read the next block of input to the buffer of the parser, from fd,
+ * or from the string when fd is -1. Returns the number of bytes read,
+ * 0 at the end of the input, or -1 with errno set.
  */
-CAMLprim value
-expat_XML_SetEndCDataHandler(value parser, value handler)
+static ssize_t
+rewrite_read(struct expat_rewrite *rw, int fd, value string, size_t *pos)
 {
-    CAMLparam2(parser, handler);
-    CAMLreturn (set_end_cdata_handler(parser, end_cdata_handler, handler));
+    size_t len = caml_string_length(string);
+    struct expat_memory *saved = expat_current_memory;
+    void *buf;
+    ssize_t n;
+    int err;
+
+    expat_current_memory = rw->memory;
+    buf = XML_GetBuffer(rw->parser, EXPAT_READ_SIZE);
+    memory_leave(saved);
+    if(buf == NULL) {
+	errno = ENOMEM;
+	return -1;
+    }
+    if(fd < 0) {
+	n = len - *pos > EXPAT_READ_SIZE ? EXPAT_READ_SIZE : len - *pos;
+	memcpy(buf, String_val(string) + *pos, n);
+	*pos += n;
+	return n;
+    }
+    do {
+	caml_release_runtime_system();
+	n = read(fd, buf, EXPAT_READ_SIZE);
+	err = errno;
+	caml_acquire_runtime_system();
+	if(n < 0 && err == EINTR)
+	    caml_process_pending_actions();
+    } while(n < 0 && err == EINTR);
+    errno = err;
+    return n;
 }
 
 /*
- * external reset_end_cdata_handler : expat_parser -> unit =
- *   "expat_XML_ResetEndCDataHandler"
+ * external rewrite : string list -> handler -> Unix.file_descr option ->
+ *   string -> Unix.file_descr option -> string = "expat_Rewrite"
+ *
+ * Rewrite the document read from the input descriptor, or in the string
+ * when there is none. The output is written to the output descriptor
+ * after each block of input, or returned when there is none.
  */
 CAMLprim value
-expat_XML_ResetEndCDataHandler(value parser)
+expat_Rewrite(value names, value handler, value input, value string,
+	      value output)
 {
-    CAMLparam1(parser);
-    CAMLreturn (set_end_cdata_handler(parser, NULL, Val_unit));
-}
+    CAMLparam5(names, handler, input, string, output);
+    CAMLlocal2(exn, result);
+    struct expat_rewrite rw;
+    struct expat_memory *saved;
+    int in_fd = Is_block(input) ? Int_val(Field(input, 0)) : -1;
+    int out_fd = Is_block(output) ? Int_val(Field(output, 0)) : -1;
+    size_t pos = 0;
+    ssize_t n;
+    int status, error, err;
+
+    memset(&rw, 0, sizeof rw);
+    exn = Val_unit;
+    rw.handler = &handler;
+    rw.exn = &exn;
+    rw.memory = memory_create(0);
+    rw.names = symbols_create();
+    rw.parser = xml_parser_create(NULL, NULL, rw.memory);
+    for(; rw.names != NULL && names != Val_emptylist; names = Field(names, 1))
+	if(symbols_intern(rw.names, String_val(Field(names, 0)),
+			  caml_string_length(Field(names, 0))) < 0)
+	    break;
+    if(rw.names == NULL || rw.parser == NULL || names != Val_emptylist) {
+	rewrite_free(&rw);
+	caml_raise_out_of_memory();
+    }
+    XML_SetUserData(rw.parser, &rw);
+    XML_SetDefaultHandler(rw.parser, rewrite_default);
+    XML_SetXmlDeclHandler(rw.parser, rewrite_xml_decl);
+    XML_SetStartElementHandler(rw.parser, rewrite_start_element);
+
+    do {
+	n = rewrite_read(&rw, in_fd, string, &pos);
+	if(n < 0) {
+	    err = errno;
+	    rewrite_free(&rw);
+	    if(err == ENOMEM)
+		caml_raise_out_of_memory();
+	    errno = err;
+	    uerror("read", Nothing);
+	}
+	saved = expat_current_memory;
+	expat_current_memory = rw.memory;
+	status = XML_ParseBuffer(rw.parser, n, n == 0);
+	memory_leave(saved);
+	rewrite_flush_run(&rw);
+	if(status == XML_STATUS_OK && !rw.failed)
+	    rewrite_write(&rw, out_fd);
+    } while(status == XML_STATUS_OK && n > 0);
+    error = XML_GetErrorCode(rw.parser);
+
+    if(rw.failed || status != XML_STATUS_OK) {
+	rewrite_free(&rw);
+	if(exn != Val_unit)
+	    caml_raise(exn);
+	if(rw.invalid)
+	    caml_invalid_argument("Expat.Rewrite");
+	if(rw.failed)
+	    caml_raise_out_of_memory();
+	expat_error(error);
+    }
 
+    result = caml_alloc_initialized_string(rw.out.len, rw.out.data);
+    rewrite_free(&rw);
+    CAMLreturn (result);
+}
 
 /*
- * Default handler, setting and resetting
+ * Writing, used by the Writer module of expat.ml, which keeps track of
+ * the open elements.
+ *
+ * The output is kept in a C buffer, which is reused once it has been
+ * taken or written to the file descriptor of the writer. The last
+ * start tag is left open until it is known whether the element is
+ * empty.
  */
+struct expat_writer {
+    struct expat_buffer out;
+    int fd;		/* where the output is written, or -1 */
+    int tag_open;
+};
+
+#define Writer_val(v) (*((struct expat_writer **) Data_custom_val(v)))
+
 static void
-default_handler(void *user_data, const char *data, int len)
+writer_finalize(value writer)
 {
-    CAMLparam0();
-    CAMLlocal1(d);
-    value *handlers = user_data;
+    struct expat_writer *w = Writer_val(writer);
 
-    d = caml_alloc_string(len);
-    memmove(String_val(d), data, len);
-    caml_callback(Field(*handlers, EXPAT_DEFAULT_HANDLER), d);
+    buffer_free(&w->out);
+    caml_stat_free(w);
+}
 
-    CAMLreturn0;
+static struct custom_operations writer_ops = {
+    "Expat_Writer",
+    writer_finalize,
+    custom_compare_default,
+    custom_hash_default,
+    custom_serialize_default,
+    custom_deserialize_default
+};
+
+static void
+writer_append(struct expat_writer *w, const char *s, size_t len)
+{
+    if(!buffer_append(&w->out, s, len))
+	caml_raise_out_of_memory();
 }
 
-static value
-set_default_handler(value parser,
-		    XML_DefaultHandler c_handler,
-		    value ocaml_handler)
+static void
+writer_close_tag(struct expat_writer *w)
 {
-    CAMLparam2(parser, ocaml_handler);
-    XML_Parser xml_parser = XML_Parser_val(parser);
-    value *handlers = XML_GetUserData(xml_parser);
+    if(w->tag_open) {
+	w->tag_open = 0;
+	writer_append(w, ">", 1);
+    }
+}
 
-    Store_field(*handlers, EXPAT_DEFAULT_HANDLER, ocaml_handler);
-    XML_SetDefaultHandler(xml_parser, c_handler);
+/*
+ * Append escaped text, or raise Invalid_argument, leaving the output as
+ * it was, when there is a control character in it.
+ */
+static void
+writer_escape(struct expat_writer *w, const char *s, size_t len, int attr,
+	      size_t mark, const char *fn)
+{
+    int status = escape_append(&w->out, s, len, attr);
 
-    CAMLreturn (Val_unit);
+    if(status <= 0) {
+	w->out.len = mark;
+	if(status == 0)
+	    caml_raise_out_of_memory();
+	caml_invalid_argument(fn);
+    }
 }
 
 /*
- * external set_default_handler : expat_parser -> (string -> unit) -> unit =
- *   "expat_XML_SetDefaultHandler"
+ * Write the output once there is a block of it.
  */
-CAMLprim value
-expat_XML_SetDefaultHandler(value parser, value handler)
+static void
+writer_done(struct expat_writer *w)
 {
-    CAMLparam2(parser, handler);
-    CAMLreturn (set_default_handler(parser, default_handler, handler));
+    if(w->fd >= 0 && w->out.len >= EXPAT_READ_SIZE
+       && buffer_write(&w->out, w->fd) < 0)
+	uerror("write", Nothing);
 }
 
 /*
- * external reset_default_handler : expat_parser -> unit =
- *   "expat_XML_ResetDefaultHandler"
+ * external writer_create : Unix.file_descr option -> writer =
+ *   "expat_WriterCreate"
  */
 CAMLprim value
-expat_XML_ResetDefaultHandler(value parser)
+expat_WriterCreate(value fd)
 {
-    CAMLparam1(parser);
-    CAMLreturn (set_default_handler(parser, NULL, Val_unit));
+    CAMLparam1(fd);
+    CAMLlocal1(writer);
+    struct expat_writer *w = caml_stat_alloc(sizeof *w);
+
+    memset(w, 0, sizeof *w);
+    w->fd = Is_block(fd) ? Int_val(Field(fd, 0)) : -1;
+    writer = caml_alloc_custom_mem(&writer_ops, sizeof w, sizeof *w);
+    Writer_val(writer) = w;
+    CAMLreturn (writer);
 }
 
-
-
 /*
- * External Entity Ref handler, setting and resetting
+ * external writer_start_element : writer -> string ->
+ *   (string * string) list -> unit = "expat_WriterStartElement"
  */
-static int
-external_entity_ref_handler(XML_Parser xml_parser,
-			    const char *context, const char *base,
-			    const char *systemId, const char *publicId)
+CAMLprim value
+expat_WriterStartElement(value writer, value name, value attrs)
 {
-    CAMLparam0();
-    CAMLlocal4(caml_context, caml_base, caml_systemId, caml_publicId);
-    value *handlers = XML_GetUserData(xml_parser);
-    value arg[4];
-
-    /*
-     * Now put the strings into ocaml values. The parameters context,
-     * base, and publicId are optional systemId is never optional.
-     */
-    caml_context = Val_option_string(context);
-    caml_base = Val_option_string(base);
-    caml_systemId = caml_copy_string(systemId);
-    caml_publicId = Val_option_string(publicId);
-
-    /* Call the callback which has more than 3 parameters */
-    arg[0] = caml_context;
-    arg[1] = caml_base;
-    arg[2] = caml_systemId;
-    arg[3] = caml_publicId;
-    caml_callbackN(Field(*handlers, EXPAT_EXTERNAL_ENTITY_REF_HANDLER), 4, arg);
-
-    CAMLreturn (XML_STATUS_OK);
+    CAMLparam3(writer, name, attrs);
+    struct expat_writer *w = Writer_val(writer);
+    size_t mark;
+    value attr;
+
+    writer_close_tag(w);
+    mark = w->out.len;
+    writer_append(w, "<", 1);
+    writer_append(w, String_val(name), caml_string_length(name));
+    for(; attrs != Val_emptylist; attrs = Field(attrs, 1)) {
+	attr = Field(attrs, 0);
+	writer_append(w, " ", 1);
+	writer_append(w, String_val(Field(attr, 0)),
+		      caml_string_length(Field(attr, 0)));
+	writer_append(w, "=\"", 2);
+	writer_escape(w, String_val(Field(attr, 1)),
+		      caml_string_length(Field(attr, 1)), 1, mark,
+		      "Expat.Writer.start_element");
+	writer_append(w, "\"", 1);
+    }
+    w->tag_open = 1;
+    writer_done(w);
+    CAMLreturn (Val_unit);
 }
 
-static value
-set_external_entity_ref_handler(value parser,
-				XML_ExternalEntityRefHandler c_handler,
-				value ocaml_handler)
+/*
+ * external writer_end_element : writer -> string -> unit =
+ *   "expat_WriterEndElement"
+ */
+CAMLprim value
+expat_WriterEndElement(value writer, value name)
 {
-    CAMLparam2(parser, ocaml_handler);
-    XML_Parser xml_parser = XML_Parser_val(parser);
-    value *handlers = XML_GetUserData(xml_parser);
-
-    Store_field(*handlers, EXPAT_EXTERNAL_ENTITY_REF_HANDLER, ocaml_handler);
-    XML_SetExternalEntityRefHandler(xml_parser, c_handler);
+    CAMLparam2(writer, name);
+    struct expat_writer *w = Writer_val(writer);
 
+    if(w->tag_open) {
+	w->tag_open = 0;
+	writer_append(w, "/>", 2);
+    } else {
+	writer_append(w, "</", 2);
+	writer_append(w, String_val(name), caml_string_length(name));
+	writer_append(w, ">", 1);
+    }
+    writer_done(w);
     CAMLreturn (Val_unit);
 }
 
 /*
- * external set_external_entity_ref_handler : expat_parser ->
- *   (string option -> string option -> string -> string option -> unit) ->
- *     unit = "expat_XML_SetExternalEntityRefHandler"
+ * external writer_text : writer -> string -> unit = "expat_WriterText"
  */
 CAMLprim value
-expat_XML_SetExternalEntityRefHandler(value parser, value handler)
+expat_WriterText(value writer, value text)
 {
-    CAMLparam2(parser, handler);
-    CAMLreturn (set_external_entity_ref_handler(parser,
-						external_entity_ref_handler,
-						handler));
+    CAMLparam2(writer, text);
+    struct expat_writer *w = Writer_val(writer);
+
+    if(caml_string_length(text) == 0)
+	CAMLreturn (Val_unit);
+    writer_close_tag(w);
+    writer_escape(w, String_val(text), caml_string_length(text), 0,
+		  w->out.len, "Expat.Writer.text");
+    writer_done(w);
+    CAMLreturn (Val_unit);
 }
 
 /*
- * external reset_external_entity_ref_handler : expat_parser -> unit =
- *   "expat_XML_ResetDefaultHandler"
+ * external writer_raw : writer -> string -> unit = "expat_WriterRaw"
  */
 CAMLprim value
-expat_XML_ResetExternalEntityRefHandler(value parser)
+expat_WriterRaw(value writer, value s)
 {
-    CAMLparam1(parser);
-    CAMLreturn (set_external_entity_ref_handler(parser, NULL, Val_unit));
-}
+    CAMLparam2(writer, s);
+    struct expat_writer *w = Writer_val(writer);
 
+    writer_close_tag(w);
+    writer_append(w, String_val(s), caml_string_length(s));
+    writer_done(w);
+    CAMLreturn (Val_unit);
+}
 
+/*
+ * external writer_contents : writer -> string = "expat_WriterContents"
+ *
+ * Take the output, which is emptied.
+ */
+CAMLprim value
+expat_WriterContents(value writer)
+{
+    CAMLparam1(writer);
+    CAMLlocal1(result);
+    struct expat_writer *w = Writer_val(writer);
+
+    writer_close_tag(w);
+    result = caml_alloc_initialized_string(w->out.len, w->out.data);
+    w->out.len = 0;
+    CAMLreturn (result);
+}
 
+/*
+ * external writer_flush : writer -> unit = "expat_WriterFlush"
+ */
+CAMLprim value
+expat_WriterFlush(value writer)
+{
+    CAMLparam1(writer);
+    struct expat_writer *w = Writer_val(writer);
 
+    writer_close_tag(w);
+    if(w->fd >= 0 && buffer_write(&w->out, w->fd) < 0)
+	uerror("write", Nothing);
+    CAMLreturn (Val_unit);
+}
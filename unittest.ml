@@ -19,9 +19,14 @@ let xml_errors =
    UNKNOWN_ENCODING; INCORRECT_ENCODING; UNCLOSED_CDATA_SECTION;
    EXTERNAL_ENTITY_HANDLING; NOT_STANDALONE; UNEXPECTED_STATE;
    ENTITY_DECLARED_IN_PE; FEATURE_REQUIRES_XML_DTD;
-   CANT_CHANGE_FEATURE_ONCE_PARSING;] ;;
+   CANT_CHANGE_FEATURE_ONCE_PARSING; UNBOUND_PREFIX; UNDECLARING_PREFIX;
+   INCOMPLETE_PE; XML_DECL; TEXT_DECL; PUBLICID; SUSPENDED; NOT_SUSPENDED;
+   ABORTED; FINISHED; SUSPEND_PE; RESERVED_PREFIX_XML; RESERVED_PREFIX_XMLNS;
+   RESERVED_NAMESPACE_URI; INVALID_ARGUMENT; NO_BUFFER;
+   AMPLIFICATION_LIMIT_BREACH;] ;;
 
 let (@=?) = assert_equal ~printer:string_of_int
+let (@=$) = assert_equal ~printer:(fun s -> s)
 
 let rec loop f = function
     0 -> ()
@@ -196,6 +201,119 @@ let suite = "expat" >:::
 	  final p;
 	  assert_equal "/a/b/c/d/e" (Buffer.contents buf) ~printer:(fun x->x));
 
+   "lazy start element handler" >::
+     (fun _ ->
+	let p = parser_create None in
+	let buf = Buffer.create 10 in
+	let saved = ref None in
+	let start_handler tag attrs =
+	  Buffer.add_string buf tag;
+	  for i = 0 to attributes_length attrs - 1 do
+	    Printf.bprintf buf " %s=%s"
+	      (attribute_name attrs i) (attribute_value attrs i)
+	  done;
+	  (match find_attribute attrs "id" with
+	       Some id -> Printf.bprintf buf " #%s" id
+	     | None -> ());
+	  Buffer.add_string buf ";";
+	  assert_raises (Invalid_argument "index out of bounds")
+	    (fun () -> attribute_name attrs (attributes_length attrs));
+	  saved := Some attrs
+	in
+	  set_start_element_handler_lazy p start_handler;
+	  parse p "<a x='1' id='top'><b/><c y='2'/></a>";
+	  final p;
+	  assert_equal "a x=1 id=top #top;b;c y=2;" (Buffer.contents buf)
+	    ~printer:(fun x -> x);
+	  (match !saved with
+	       Some attrs ->
+		 assert_raises (Invalid_argument "Expat.attributes")
+		   (fun () -> attributes_length attrs)
+	     | None -> assert_failure "no element");
+	  reset_start_element_handler p;
+	  parser_reset p None;
+	  parse p "<d/>";
+	  final p;
+	  assert_equal "a x=1 id=top #top;b;c y=2;" (Buffer.contents buf)
+	    ~printer:(fun x -> x));
+
+   "symbol handlers" >::
+     (fun _ ->
+	let p = parser_create None in
+	let a = intern p "a" in
+	let b = intern p "b" in
+	let buf = Buffer.create 10 in
+	  assert_equal a (intern p "a");
+	  assert_equal "b" (symbol_name p b);
+	  set_start_element_handler_sym p
+	    (fun sym attrs ->
+	       Buffer.add_string buf
+		 (if sym = a then "A" else if sym = b then "B"
+		  else "<" ^ symbol_name p sym ^ ">");
+	       for i = 0 to attributes_length attrs - 1 do
+		 Buffer.add_string buf
+		   (if attribute_symbol attrs i = b then "b"
+		    else symbol_name p (attribute_symbol attrs i))
+	       done);
+	  set_end_element_handler_sym p
+	    (fun sym -> Buffer.add_string buf (string_of_int sym));
+	  parse p "<a><b b='1'/><c d='2'/></a>";
+	  final p;
+	  let c = intern p "c" in
+	  let d = intern p "d" in
+	    assert_equal (Printf.sprintf "ABb%d<c>d%d%d" b c a)
+	      (Buffer.contents buf) ~printer:(fun x -> x);
+	    assert_equal "d" (symbol_name p d);
+	    parser_reset p None;
+	    assert_equal c (intern p "c");
+	    let child = external_entity_parser_create p None None in
+	      assert_equal d (intern child "d");
+	      assert_raises (Invalid_argument "Expat.symbol_name")
+		(fun () -> symbol_name p 1000)
+     );
+
+   "namespace handlers" >::
+     (fun _ ->
+	let p = parser_create_ns None '|' in
+	let buf = Buffer.create 10 in
+	let ns id = if id < 0 then "" else "{" ^ symbol_name p id ^ "}" in
+	  set_start_namespace_decl_handler p
+	    (fun prefix uri ->
+	       Printf.bprintf buf "+%s=%s "
+		 (Option.value prefix ~default:"") (Option.value uri ~default:""));
+	  set_end_namespace_decl_handler p
+	    (fun prefix ->
+	       Printf.bprintf buf "-%s " (Option.value prefix ~default:""));
+	  set_start_element_handler_ns p
+	    (fun id local attrs ->
+	       Printf.bprintf buf "<%s%s" (ns id) local;
+	       for i = 0 to attributes_length attrs - 1 do
+		 Printf.bprintf buf " %s%s"
+		   (ns (attribute_namespace attrs i)) (attribute_local_name attrs i)
+	       done;
+	       Buffer.add_string buf "> ");
+	  set_end_element_handler_ns p
+	    (fun id local -> Printf.bprintf buf "</%s%s> " (ns id) local);
+	  parse p ("<a xmlns='urn:a' xmlns:b='urn:b'>" ^
+		   "<b:c b:x='1' y='2'/><d xmlns=''/></a>");
+	  final p;
+	  assert_equal
+	    ("+=urn:a +b=urn:b <{urn:a}a> <{urn:b}c {urn:b}x y> </{urn:b}c> " ^
+	     "+= <d> </d> - </{urn:a}a> -b - ")
+	    (Buffer.contents buf) ~printer:(fun x -> x);
+	  assert_equal (intern p "urn:a") (intern p "urn:a");
+	  (* the separator may occur in the URI, and children split too *)
+	  let p = parser_create_ns None ':' in
+	  let name = ref "" in
+	    set_start_element_handler_ns p
+	      (fun id local _ -> name := symbol_name p id ^ " " ^ local);
+	    parse p "<a xmlns='http://x/'>";
+	    "http://x/ a" @=$ !name;
+	    let child = external_entity_parser_create p None None in
+	      parse child "<b xmlns='http://y/'/>";
+	      "http://y/ b" @=$ !name
+     );
+
    "end element handler" >::
      (fun _ ->
 	let p = parser_create None in
@@ -237,6 +355,205 @@ let suite = "expat" >:::
 	    (Buffer.contents buf)
 	    ~printer:String.escaped);
 
+   "character data coalescing" >::
+     (fun _ ->
+	let p = parser_create None in
+	let texts = ref [] in
+	  set_character_data_handler p (fun s -> texts := s :: !texts);
+	  set_character_data_coalescing p true;
+	  parse p "<a>one\ntwo &amp; thr";
+	  parse p "ee<b/>four<!-- c -->five</a>";
+	  final p;
+	  assert_equal ["one\ntwo & three"; "fourfive"] (List.rev !texts)
+	    ~printer:(String.concat "|");
+	  texts := [];
+	  set_comment_handler p (fun _ -> texts := "#" :: !texts);
+	  parser_reset p None;
+	  parse p "<a>four<!-- c -->five<![CDATA[six]]></a>";
+	  final p;
+	  assert_equal ["four"; "#"; "fivesix"] (List.rev !texts)
+	    ~printer:(String.concat "|");
+	  texts := [];
+	  set_character_data_coalescing p false;
+	  parser_reset p None;
+	  parse p "<a>1\n2</a>";
+	  final p;
+	  assert_equal ["1"; "\n"; "2"] (List.rev !texts)
+	    ~printer:(String.concat "|")
+     );
+
+   "ignore whitespace" >::
+     (fun _ ->
+	let p = parser_create None in
+	let texts = ref [] in
+	let doc =
+	  "<a>\n  <b> x </b>\n  <p>\n <i>i</i> \n</p>\n" ^
+	    String.make 40 ' ' ^ "<c/></a>"
+	in
+	let check expected =
+	  texts := [];
+	  parse p doc;
+	  final p;
+	  parser_reset p None;
+	  assert_equal expected (List.rev !texts) ~printer:(String.concat "|")
+	in
+	  set_character_data_handler p (fun s -> texts := s :: !texts);
+	  set_ignore_whitespace p true;
+	  set_character_data_coalescing p true;
+	  check [" x "; "i"];
+	  set_mixed_content_elements p ["p"];
+	  check [" x "; "\n "; "i"; " \n"];
+	  set_character_data_coalescing p false;
+	  set_mixed_content_elements p [];
+	  check [" x "; "i"];
+	  texts := [];
+	  parse p "<a> <b/>x\ny</a>";
+	  final p;
+	  assert_equal ["x"; "\n"; "y"] (List.rev !texts)
+	    ~printer:(String.concat "|");
+	  set_ignore_whitespace p false;
+	  parser_reset p None;
+	  check ["\n"; "  "; " x "; "\n"; "  "; "\n"; " "; "i"; " ";
+		 "\n"; "\n"; String.make 40 ' '];
+	  (* the elements open when it is changed are taken as not mixed *)
+	  texts := [];
+	  set_mixed_content_elements p ["a"];
+	  set_ignore_whitespace p true;
+	  parse p "<a><p>";
+	  set_ignore_whitespace p false;
+	  parse p "<b/>";
+	  set_ignore_whitespace p true;
+	  parse p " </p> </a>";
+	  final p;
+	  assert_equal [] (List.rev !texts) ~printer:(String.concat "|")
+     );
+
+   "substring handlers" >::
+     (fun _ ->
+	let p = parser_create None in
+	let buf = Buffer.create 10 in
+	let scratch = ref None in
+	let long = String.make 10000 'x' in
+	  set_character_data_handler_sub p
+	    (fun b off len ->
+	       scratch := Some b;
+	       Buffer.add_subbytes buf b off len;
+	       Buffer.add_char buf '|');
+	  set_default_handler_sub p
+	    (fun b off len -> Printf.bprintf buf "{%s}" (Bytes.sub_string b off len));
+	  set_character_data_coalescing p true;
+	  parse p ("<a>one<!--c-->two" ^ long ^ "</a>");
+	  final p;
+	  assert_equal ("{<a>}one|{<!--c-->}two" ^ long ^ "|{</a>}")
+	    (Buffer.contents buf) ~printer:(fun x -> x);
+	  let first = !scratch in
+	    Buffer.clear buf;
+	    parser_reset p None;
+	    parse p "<a>three</a>";
+	    final p;
+	    assert_equal "{<a>}three|{</a>}" (Buffer.contents buf)
+	      ~printer:(fun x -> x);
+	    "the buffer is reused" @? (!scratch == first)
+     );
+
+   "skip_subtree" >::
+     (fun _ ->
+	let check coalesce =
+	  let p = parser_create None in
+	  let buf = Buffer.create 10 in
+	    set_character_data_coalescing p coalesce;
+	    set_start_element_handler p
+	      (fun tag _ ->
+		 Buffer.add_string buf ("<" ^ tag ^ ">");
+		 if tag = "skip" then skip_subtree p);
+	    set_end_element_handler p
+	      (fun tag -> Buffer.add_string buf ("</" ^ tag ^ ">"));
+	    set_character_data_handler p (Buffer.add_string buf);
+	    set_processing_instruction_handler p
+	      (fun _ _ -> Buffer.add_string buf "?");
+	    parse p ("<a><skip x='1'><b>text<?pi?><skip/></b>more</skip>" ^
+		       "<c/><skip/>t<?pi?></a>");
+	    final p;
+	    "<a><skip></skip><c></c><skip></skip>t?</a>" @=$ Buffer.contents buf;
+	    assert_raises (Invalid_argument "Expat.skip_subtree")
+	      (fun () -> skip_subtree p)
+	in
+	  check false;
+	  check true
+     );
+
+   "path filter" >::
+     (fun _ ->
+	let p = parser_create None in
+	let buf = Buffer.create 10 in
+	let add = Buffer.add_string buf in
+	  set_start_element_handler p
+	    (fun tag attrs ->
+	       add ("<" ^ tag);
+	       List.iter (fun (k, v) -> add (" " ^ k ^ "=" ^ v)) attrs;
+	       add ">");
+	  set_end_element_handler p (fun tag -> add ("</" ^ tag ^ ">"));
+	  set_character_data_handler p add;
+	  set_path_filter p ["/feed/entry/id"; "//item/@sku"];
+	  parse p ("<feed><title>t</title><entry><id>1</id><x>no</x></entry>" ^
+		     "<list><item sku='a' n='1'>i<item n='2'/></item></list>" ^
+		     "<entry><id>2<b>c</b></id></entry></feed>");
+	  final p;
+	  "<id>1</id><item sku=a></item><id>2<b>c</b></id>" @=$
+	    Buffer.contents buf;
+	  Buffer.clear buf;
+	  parser_reset p None;
+	  set_path_filter p ["//b/*"];
+	  parse p "<a><b><c>x</c></b><d><b><e/></b></d></a>";
+	  final p;
+	  "<c>x</c><e></e>" @=$ Buffer.contents buf;
+	  List.iter (fun path ->
+		       assert_raises (Invalid_argument "Expat.set_path_filter")
+			 (fun () -> set_path_filter p [path]))
+	    [""; "a/b"; "/a/"; "/a//"; "/@b/c"; "/a/@"];
+	  (* local names, in a namespace whose URI has the separator *)
+	  let p = parser_create_ns None ':' in
+	  let names = ref [] in
+	    set_start_element_handler p (fun tag _ -> names := tag :: !names);
+	    set_path_filter p ["/feed/id"];
+	    parse p "<feed xmlns='http://x/'><id/><x/></feed>";
+	    final p;
+	    assert_equal ["http://x/:id"] !names ~printer:(String.concat "|")
+     );
+
+   "span handlers" >::
+     (fun _ ->
+	let doc =
+	  "<!DOCTYPE a [<!ENTITY e 'ent'>]><a x='1'>t&amp;u<b/>v&e;</a>" in
+	let check coalesce =
+	  let p = parser_create None in
+	  let spans = ref [] in
+	  let add kind start stop verbatim =
+	    spans := (kind, String.sub doc start (stop - start), verbatim)
+		     :: !spans
+	  in
+	    set_character_data_coalescing p coalesce;
+	    set_start_element_handler_span p (add "start");
+	    set_end_element_handler_span p (add "end");
+	    set_character_data_handler_span p (add "text");
+	    parse p doc;
+	    final p;
+	    List.rev !spans
+	in
+	  assert_equal
+	    [("start", "<a x='1'>", true); ("text", "t", true);
+	     ("text", "&amp;", false); ("text", "u", true);
+	     ("start", "<b/>", true); ("end", "", false);
+	     ("text", "v", true); ("text", "&e;", false);
+	     ("end", "</a>", true)]
+	    (check false);
+	  assert_equal
+	    [("start", "<a x='1'>", true); ("text", "t&amp;u", false);
+	     ("start", "<b/>", true); ("end", "", false);
+	     ("text", "v&e;", false); ("end", "</a>", true)]
+	    (check true)
+     );
+
    "processing instruction handler" >::
      (fun _ ->
 	let p = parser_create None in
@@ -417,6 +734,527 @@ let suite = "expat" >:::
 	  check_raises_Invalid_arg (fun _ -> parse_sub p "" 0 (-1));
 	  check_raises_Invalid_arg (fun _ -> parse_sub p "" 0 1));
 
+   "parse_step" >::
+     (fun _ ->
+	let p = parser_create None in
+	let buf = Buffer.create 10 in
+	let events = ref 0 in
+	let add s = incr events; Buffer.add_string buf s in
+	let rec steps () =
+	  events := 0;
+	  match parse_step p ~max_events:2 with
+	      `Suspended -> "at most 2 events" @? (!events <= 2); 1 + steps ()
+	    | `Done -> 1
+	in
+	  set_start_element_handler p (fun tag _ -> add ("<" ^ tag ^ ">"));
+	  set_end_element_handler p (fun tag -> add ("</" ^ tag ^ ">"));
+	  set_character_data_handler p add;
+	  feed p "<a><b>x</b>";
+	  assert_raises (Invalid_argument "Expat.feed") (fun () -> feed p "");
+	  3 @=? steps ();
+	  "<a><b>x</b>" @=$ Buffer.contents buf;
+	  feed p ~final:true "<c>y</c></a>";
+	  3 @=? steps ();
+	  "<a><b>x</b><c>y</c></a>" @=$ Buffer.contents buf;
+	  assert_equal `Done (parse_step p ~max_events:1)
+     );
+
+   "parse_stream" >::
+     (fun _ ->
+	let stream =
+	  "<?xml version='1.0'?>\n<a><b/>t</a>\n\
+	   <?xml version='1.0' encoding='UTF-8'?><c x='1'/>  \
+	   <d>x<!-- c --></d>\r\n" in
+	let parse chunk_size =
+	  let p = parser_create None in
+	  let events = ref [] in
+	  let add ev = events := ev :: !events in
+	    set_start_element_handler p (fun name _ -> add ("<" ^ name));
+	    set_end_element_handler p (fun name -> add ("/" ^ name));
+	    set_character_data_handler p add;
+	    let rec loop pos =
+	      let len = min chunk_size (String.length stream - pos) in
+	      let final = pos + len = String.length stream in
+		parse_stream p ~final ~document_end:(fun () -> add "|")
+		  (String.sub stream pos len);
+		if not final then loop (pos + len)
+	    in
+	      loop 0;
+	      List.rev !events
+	in
+	let expected = ["<a"; "<b"; "/b"; "t"; "/a"; "|"; "<c"; "/c"; "|";
+			"<d"; "x"; "/d"; "|"] in
+	  List.iter (fun chunk_size -> assert_equal expected (parse chunk_size))
+	    [1; 7; 16; String.length stream];
+	  let p = parser_create None in
+	    assert_raises (Expat_error NO_ELEMENTS)
+	      (fun () -> parse_stream p ~final:true "<a/><!-- c -->");
+	    let p = parser_create None in
+	      assert_raises (Expat_error UNCLOSED_TOKEN)
+		(fun () -> parse_stream p ~final:true "<a/>\n<b");
+	      let p = parser_create None in
+		feed p "<a/>";
+		assert_raises (Invalid_argument "Expat.parse_stream")
+		  (fun () -> parse_stream p "<a/>");
+		(* the documents are in the encoding of the parser *)
+		let p = parser_create (Some "ISO-8859-1") in
+		let texts = ref [] in
+		  set_character_data_handler p (fun s -> texts := s :: !texts);
+		  parse_stream p ~final:true "<a>\xe9</a><b>\xe8</b>";
+		  assert_equal ["\xc3\xa9"; "\xc3\xa8"] (List.rev !texts)
+		    ~printer:(String.concat "|");
+		  (* parser_reset ends the stream *)
+		  parser_reset p None;
+		  parse p "<a/>";
+		  parse p "<!-- c -->";
+		  final p;
+		  (* stopping at the end of a document stops the stream *)
+		  let p = parser_create None in
+		  let events = ref [] in
+		    set_start_element_handler p
+		      (fun name _ -> events := name :: !events);
+		    set_end_element_handler p (fun _ -> stop p);
+		    parse_stream p ~final:true
+		      ~document_end:(fun () -> events := "|" :: !events)
+		      "<a/><b/>";
+		    assert_equal ["a"] !events ~printer:(String.concat " ")
+     );
+
+   "parse_bigarray" >::
+     (fun _ ->
+	let p = parser_create None in
+	let buf = Buffer.create 10 in
+	let store_data str =
+	  Buffer.add_string buf "#";
+	  Buffer.add_string buf str;
+	  Buffer.add_string buf "#";
+	in
+	  set_default_handler p store_data;
+	  let str = "<a><b><c/></b><d>blah blah<e/></d></a>" in
+	  let ba = Bigarray.Array1.create Bigarray.char Bigarray.c_layout
+		     (String.length str) in
+	    String.iteri (fun i c -> ba.{i} <- c) str;
+	    parse_bigarray_sub p ba 0 10;
+	    parse_bigarray_sub p ba 10 10;
+	    parse_bigarray_sub p ba 20 18;
+	    final p;
+	    assert_equal
+	      "#<a>##<b>##<c/>##</b>##<d>##bla##h blah##<e/>##</d>##</a>#"
+	      (Buffer.contents buf) ~printer:(fun x->x);
+	    let check_raises_Invalid_arg f =
+	      try
+		f();
+		assert_string("No invalid_arg raised")
+	      with Invalid_argument(s) ->
+		()
+	    in
+	      check_raises_Invalid_arg (fun _ -> parse_bigarray_sub p ba (-1) 0);
+	      check_raises_Invalid_arg (fun _ -> parse_bigarray_sub p ba 0 39)
+     );
+
+   "parse_file_mmap" >::
+     (fun _ ->
+	let count_elements parse =
+	  let n = ref 0 in
+	  let p = parser_create None in
+	    set_start_element_handler p (fun _ _ -> incr n);
+	    parse p;
+	    final p;
+	    !n
+	in
+	let from_channel p =
+	  let ic = open_in_bin "REC-xml-19980210.xml" in
+	  let s = really_input_string ic (in_channel_length ic) in
+	    close_in ic;
+	    parse p s
+	in
+	  (count_elements from_channel) @=?
+	    (count_elements (fun p -> parse_file_mmap p "REC-xml-19980210.xml"))
+     );
+
+   "parse_fd & parse_channel" >::
+     (fun _ ->
+	let count_elements parse =
+	  let n = ref 0 in
+	  let p = parser_create None in
+	    set_start_element_handler p (fun _ _ -> incr n);
+	    parse p;
+	    final p;
+	    !n
+	in
+	let expected =
+	  count_elements (fun p -> parse_file_mmap p "REC-xml-19980210.xml")
+	in
+	let from_fd p =
+	  let fd = Unix.openfile "REC-xml-19980210.xml" [Unix.O_RDONLY] 0 in
+	    parse_fd p fd;
+	    Unix.close fd
+	in
+	let from_channel p =
+	  let ic = open_in_bin "REC-xml-19980210.xml" in
+	    (* make sure data which is already buffered is not lost *)
+	    ignore (input_char ic);
+	    parse p "<";
+	    parse_channel p ic;
+	    close_in ic
+	in
+	  expected @=? (count_elements from_fd);
+	  expected @=? (count_elements from_channel)
+     );
+
+   "batched events" >::
+     (fun _ ->
+	let p = parser_create None in
+	let buf = Buffer.create 10 in
+	let batches = ref 0 in
+	let store_event = function
+	    Start_element (tag, attrs) ->
+	      Buffer.add_string buf ("<" ^ tag);
+	      List.iter (fun (k, v) -> Buffer.add_string buf (" " ^ k ^ "=" ^ v))
+		attrs;
+	      Buffer.add_string buf ">"
+	  | End_element tag -> Buffer.add_string buf ("</" ^ tag ^ ">")
+	  | Character_data str -> Buffer.add_string buf ("#" ^ str ^ "#")
+	in
+	  set_event_batch_handler p
+	    (fun events -> incr batches; iter_events store_event events);
+	  parse p "<a x='1' y='2'><b>bla</b>";
+	  1 @=? !batches;
+	  parse p "<c/></a>";
+	  2 @=? !batches;
+	  final p;
+	  2 @=? !batches;
+	  assert_equal "<a x=1 y=2><b>#bla#</b><c></c></a>"
+	    (Buffer.contents buf) ~printer:(fun x -> x);
+	  let p = parser_create None in
+	  let n = ref 0 in
+	    set_event_batch_handler p (fun _ -> incr n);
+	    reset_event_batch_handler p;
+	    parse p "<a/>";
+	    0 @=? !n
+     );
+
+   "Pull" >::
+     (fun _ ->
+	let xml = "<a x='1'><b>bla</b><c/>text</a>" in
+	let rec events c =
+	  match Pull.next c with
+	      ev -> ev :: events c
+	    | exception End_of_file -> []
+	in
+	let expected =
+	  [Start_element ("a", [("x", "1")]); Start_element ("b", []);
+	   Character_data "bla"; End_element "b"; Start_element ("c", []);
+	   End_element "c"; Character_data "text"; End_element "a"] in
+	  assert_equal expected (events (Pull.of_string ~batch:1 xml));
+	  assert_equal expected (events (Pull.of_string xml));
+	  let ba = Bigarray.Array1.create Bigarray.char Bigarray.c_layout
+		     (String.length xml) in
+	    String.iteri (fun i c -> ba.{i} <- c) xml;
+	    assert_equal expected (events (Pull.of_bigarray ~batch:2 ba));
+	    (* a recursive descent decoder *)
+	    let c = Pull.of_string ~batch:1 xml in
+	    let rec element () =
+	      match Pull.next c with
+		  Start_element (tag, _) ->
+		    let children = content () in
+		      ignore (Pull.next c);
+		      tag ^ "(" ^ String.concat "," children ^ ")"
+		| _ -> assert_failure "start element expected"
+	    and content () =
+	      match Pull.peek c with
+		  Start_element _ -> let e = element () in e :: content ()
+		| Character_data s -> ignore (Pull.next c); s :: content ()
+		| End_element _ -> []
+	    in
+	      "a(b(bla),c(),text)" @=$ element ();
+	      assert_raises End_of_file (fun () -> Pull.next c);
+	      assert_raises (Expat_error TAG_MISMATCH)
+		(fun () -> events (Pull.of_string "<a></b>"));
+	      (* the other handlers of the parser do not count in the batch *)
+	      let p = parser_create None in
+	      let comments = ref 0 in
+		set_comment_handler p (fun _ -> incr comments);
+		assert_equal [Start_element ("a", []); End_element "a"]
+		  (events (Pull.of_string ~parser:p ~batch:1
+			     "<a><!--x--><!--y--></a>"));
+		2 @=? !comments
+     );
+
+   "Tree" >::
+     (fun _ ->
+	let t = Tree.parse "<a x='1' y='&amp;'>te<!-- c -->xt<b/><c>y</c>z</a>" in
+	let root = Tree.root t in
+	let rec show node =
+	  if Tree.is_element t node then
+	    Tree.name t node ^ "(" ^
+	      String.concat "," (List.map show (Tree.children t node)) ^ ")"
+	  else Tree.text t node
+	in
+	  "a(text,b(),c(y),z)" @=$ show root;
+	  6 @=? Tree.length t;
+	  assert_equal [("x", "1"); ("y", "&")] (Tree.attributes t root);
+	  let attribute = assert_equal ~printer:(Option.value ~default:"-") in
+	    attribute (Some "&") (Tree.attribute t root "y");
+	    attribute None (Tree.attribute t root "z");
+	    "textyz" @=$ Tree.text t root;
+	    assert_raises (Expat_error TAG_MISMATCH)
+	      (fun () -> Tree.parse "<a></b>");
+	    let t = Tree.parse ~ns:'|' "<a xmlns='urn:x'><b/></a>" in
+	      "urn:x|a" @=$ Tree.name t (Tree.root t)
+     );
+
+   "Rewrite" >::
+     (fun _ ->
+	let doc =
+	  "<?xml version='1.0'?>\n<!DOCTYPE a [<!ENTITY e 'ent'>]>\n\
+	   <a k='v'>t&amp;&e;<!-- c --><b x='1'/><b  x=\"2\" ></b>\
+	   <c x='3'><![CDATA[<x>]]></c><?pi d?>\r\n</a>" in
+	let rw = Rewrite.create () in
+	  doc @=$ Rewrite.string rw doc;
+	  Rewrite.on_start_element rw "b" (fun name attrs ->
+	    "b" @=$ name;
+	    if List.assoc "x" attrs = "1" then
+	      Some (List.map (fun (k, v) ->
+		      (k, if k = "x" then "<\"&\n" else v)) attrs)
+	    else None);
+	  Rewrite.on_start_element rw "c" (fun _ _ -> Some []);
+	  "<?xml version='1.0'?>\n<!DOCTYPE a [<!ENTITY e 'ent'>]>\n\
+	   <a k='v'>t&amp;&e;<!-- c --><b x=\"&lt;&quot;&amp;&#10;\"/>\
+	   <b  x=\"2\" ></b><c><![CDATA[<x>]]></c><?pi d?>\r\n</a>"
+	  @=$ Rewrite.string rw doc;
+	  Rewrite.on_start_element rw "c" (fun _ _ -> failwith "c");
+	  assert_raises (Failure "c") (fun () -> Rewrite.string rw doc);
+	  assert_raises (Expat_error TAG_MISMATCH)
+	    (fun () -> Rewrite.string rw "<a></b>");
+	  "<?xml version=\"1.0\" standalone=\"yes\"?>\n<a>\xc3\xa9</a>" @=$
+	    Rewrite.string rw
+	      "<?xml version='1.0' encoding='ISO-8859-1' standalone='yes'?>\n\
+	       <a>\xe9</a>"
+     );
+
+   "Writer" >::
+     (fun _ ->
+	let w = Writer.create () in
+	  Writer.raw w "<?xml version=\"1.0\"?>";
+	  Writer.start_element w "a" [("x", "<\"&'\t\n>")];
+	  Writer.text w "text < & > \"quoted\"\n\r with a long clean tail";
+	  Writer.start_element w "b" [];
+	  Writer.end_element w;
+	  Writer.start_element w "c" [];
+	  Writer.text w "";
+	  Writer.end_element w;
+	  1 @=? Writer.depth w;
+	  assert_raises (Invalid_argument "Expat.Writer.text")
+	    (fun () -> Writer.text w "bell \007");
+	  assert_raises (Invalid_argument "Expat.Writer.start_element")
+	    (fun () -> Writer.start_element w "d" [("x", "\000")]);
+	  Writer.end_element w;
+	  assert_raises (Invalid_argument "Expat.Writer.end_element")
+	    (fun () -> Writer.end_element w);
+	  let doc = Writer.contents w in
+	    "<?xml version=\"1.0\"?><a x=\"&lt;&quot;&amp;'&#9;&#10;&gt;\">\
+	     text &lt; &amp; &gt; \"quoted\"\n&#13; with a long clean tail\
+	     <b/><c/></a>" @=$ doc;
+	    "" @=$ Writer.contents w;
+	    (* what was written is parsed back *)
+	    let p = parser_create None in
+	    let buf = Buffer.create 64 in
+	      set_start_element_handler p (fun _ attrs ->
+		Option.iter (Buffer.add_string buf) (List.assoc_opt "x" attrs));
+	      set_character_data_handler p (Buffer.add_string buf);
+	      parse p doc;
+	      final p;
+	      "<\"&'\t\n>text < & > \"quoted\"\n\r with a long clean tail"
+	      @=$ Buffer.contents buf
+     );
+
+   "batched events without runtime lock" >::
+     (fun _ ->
+	let rec_xml = "REC-xml-19980210.xml" in
+	let count_elements parse =
+	  let n = ref 0 in
+	  let p = parser_create None in
+	    set_event_batch_handler p
+	      (iter_events (function Start_element _ -> incr n | _ -> ()));
+	    parse p;
+	    final p;
+	    !n
+	in
+	let expected =
+	  let n = ref 0 in
+	  let p = parser_create None in
+	    set_start_element_handler p (fun _ _ -> incr n);
+	    parse_file_mmap p rec_xml;
+	    final p;
+	    !n
+	in
+	let from_string p =
+	  let ic = open_in_bin rec_xml in
+	  let s = really_input_string ic (in_channel_length ic) in
+	    close_in ic;
+	    parse p s
+	in
+	let from_fd p =
+	  let fd = Unix.openfile rec_xml [Unix.O_RDONLY] 0 in
+	    parse_fd p fd;
+	    Unix.close fd
+	in
+	  expected @=? (count_elements from_string);
+	  expected @=? (count_elements (fun p -> parse_file_mmap p rec_xml));
+	  expected @=? (count_elements from_fd)
+     );
+
+   "Parallel.parse_many" >::
+     (fun _ ->
+	let count p =
+	  let n = ref 0 in
+	    set_start_element_handler p (fun _ _ -> incr n);
+	    fun () -> !n
+	in
+	let docs =
+	  List.init 8 (fun i ->
+			 Parallel.String
+			   ("<a>" ^ String.concat "" (List.init i (fun _ -> "<b/>"))
+			    ^ "</a>"))
+	in
+	  assert_equal [1; 2; 3; 4; 5; 6; 7; 8]
+	    (Parallel.parse_many ~domains:3 count docs);
+	  assert_raises (Expat_error UNCLOSED_TOKEN)
+	    (fun () ->
+	       Parallel.parse_many ~domains:2 count
+		 [Parallel.String "<a/>"; Parallel.String "<a"])
+     );
+
+   "parser_reset" >::
+     (fun _ ->
+	let p = parser_create None in
+	let buf = Buffer.create 10 in
+	  set_start_element_handler p (fun tag _ -> Buffer.add_string buf tag);
+	  parse p "<a><b/></a>";
+	  final p;
+	  parser_reset p None;
+	  parse p "<c><d/>";
+	  parser_reset p None;
+	  parse p "<e/>";
+	  final p;
+	  assert_equal "abcde" (Buffer.contents buf) ~printer:(fun x -> x);
+	  let child = external_entity_parser_create p None None in
+	    assert_raises (Invalid_argument "Expat.parser_reset")
+	      (fun () -> parser_reset child None)
+     );
+
+   "Pool" >::
+     (fun _ ->
+	let created = ref 0 in
+	let n = ref 0 in
+	let pool =
+	  Pool.create ~max_size:1
+	    (fun () ->
+	       let p = parser_create None in
+		 incr created;
+		 set_start_element_handler p (fun _ _ -> incr n);
+		 p)
+	in
+	let parse_doc doc = Pool.with_parser pool (fun p -> parse p doc; final p) in
+	  parse_doc "<a><b/></a>";
+	  parse_doc "<a/>";
+	  (try parse_doc "<a></b>" with Expat_error TAG_MISMATCH -> ());
+	  parse_doc "<a/>";
+	  1 @=? !created;
+	  5 @=? !n;
+	  let p1 = Pool.acquire pool in
+	  let p2 = Pool.acquire pool in
+	    2 @=? !created;
+	    Pool.release pool p1;
+	    Pool.release pool p2;
+	    "pool is bounded" @? (Pool.acquire pool != Pool.acquire pool);
+	    3 @=? !created
+     );
+
+   "arena parsers" >::
+     (fun _ ->
+	let check p =
+	  let buf = Buffer.create 10 in
+	    set_start_element_handler p (fun tag _ -> Buffer.add_string buf tag);
+	    for _i = 1 to 3 do
+	      parse p "<a><b/><c/></a>";
+	      final p;
+	      parser_reset p None
+	    done;
+	    "abcabcabc" @=$ Buffer.contents buf;
+	    Buffer.clear buf;
+	    let child = external_entity_parser_create p None None in
+	      parse child "<d/>";
+	      final child;
+	      "d" @=$ Buffer.contents buf;
+	      (* the parent is reset in place while the child is alive *)
+	      parser_reset p None;
+	      parse p "<e/>";
+	      final p;
+	      "de" @=$ Buffer.contents buf;
+	      ignore (Sys.opaque_identity child)
+	in
+	  check (parser_create_arena None);
+	  check (parser_create_ns_arena None '|');
+	  let p = parser_create_ns_arena None '|' in
+	  let name = ref "" in
+	    set_start_element_handler p (fun tag _ -> name := tag);
+	    parser_reset p None;
+	    parse p "<a xmlns='urn:x'/>";
+	    "urn:x|a" @=$ !name;
+	    "the arena is counted" @? (get_memory_usage p >= 65536)
+     );
+
+   "get_memory_usage" >::
+     (fun _ ->
+	let p = parser_create None in
+	let created = get_memory_usage p in
+	  "a new parser uses memory" @? (created > 0);
+	  for i = 1 to 1000 do
+	    parse p (Printf.sprintf "<element%d>" i)
+	  done;
+	  "the parser grows" @? (get_memory_usage p > created);
+	  let child = external_entity_parser_create p None None in
+	    "a child parser is accounted separately" @?
+	      (get_memory_usage child > 0)
+     );
+
+   "handler exceptions" >::
+     (fun _ ->
+	let p = parser_create None in
+	let buf = Buffer.create 10 in
+	  set_start_element_handler p
+	    (fun tag _ -> Buffer.add_string buf tag; if tag = "b" then raise Exit);
+	  set_end_element_handler p (fun tag -> Buffer.add_string buf tag);
+	  assert_raises Exit (fun () -> parse p "<a><b/><c/></a>");
+	  "ab" @=$ Buffer.contents buf;
+	  parser_reset p None;
+	  Buffer.clear buf;
+	  set_start_element_handler p (fun tag _ -> Buffer.add_string buf tag);
+	  parse p "<a><b/><c/></a>";
+	  final p;
+	  "abbcca" @=$ Buffer.contents buf
+     );
+
+   "stop" >::
+     (fun _ ->
+	let p = parser_create None in
+	let buf = Buffer.create 10 in
+	  set_start_element_handler p
+	    (fun tag _ -> Buffer.add_string buf tag; if tag = "b" then stop p);
+	  set_end_element_handler p (fun tag -> Buffer.add_string buf tag);
+	  parse p "<a><b/><c/>";
+	  parse p "<d/></a>";
+	  final p;
+	  "ab" @=$ Buffer.contents buf;
+	  parser_reset p None;
+	  Buffer.clear buf;
+	  parse p "<a><c/></a>";
+	  final p;
+	  "acca" @=$ Buffer.contents buf
+     );
+
    "set/get base" >::
      (fun _ -> let p = parser_create None in
 	assert_equal None (get_base p);